@@ -0,0 +1,124 @@
+#!/bin/sh
+
+# Usage: ./bench.sh out.json [baseline.json]
+#
+# Times interpreter and emulator hot paths through ./forth and writes results,
+# in ms, to out.json. Each benchmark is run BENCH_RUNS times and we keep the
+# fastest run, which is the most stable figure. When a baseline (a previous
+# out.json) is given, each result is compared to it and we exit with an error
+# if one of them is more than BENCH_TOLERANCE percent slower.
+
+OUT="$1"
+BASELINE="$2"
+RUNS="${BENCH_RUNS:-5}"
+TOLERANCE="${BENCH_TOLERANCE:-20}"
+
+if [ -z "$OUT" ]; then
+    echo "Usage: ./bench.sh out.json [baseline.json]" >&2
+    exit 1
+fi
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+now() {
+    date +%s%N
+}
+
+# bench name cmd...: runs cmd and appends the fastest time to results.
+bench() {
+    name="$1"
+    shift
+    best=""
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(now)
+        "$@" > /dev/null
+        t=$(( ($(now) - start) / 1000 ))
+        if [ -z "$best" ] || [ $t -lt $best ]; then
+            best=$t
+        fi
+        i=$((i+1))
+    done
+    echo "$name $best" >> "$TMP/results"
+}
+
+# Sources
+
+# find: N entries, then 20000 lookups of the oldest one, which is the worst
+# case for a chain walk.
+for n in 10 100 1000; do
+    awk -v n=$n 'BEGIN {
+        for (i=0; i<n; i++) printf "create w%04d\n", i;
+        for (i=0; i<20000; i++) print "'"'"' w0000 drop";
+    }' > "$TMP/find$n.fth"
+done
+
+# execute, deep: d16 calls d0 2^16 times through 16 levels of nesting.
+awk 'BEGIN {
+    print ": d0 1 drop ;";
+    for (i=1; i<=16; i++) printf ": d%d d%d d%d ;\n", i, i-1, i-1;
+    print "d16";
+}' > "$TMP/deep.fth"
+
+# execute, wide: one 1000 items definition, run 256 times.
+awk 'BEGIN {
+    printf ": v0";
+    for (i=0; i<500; i++) printf " 1 drop";
+    print " ;";
+    for (i=1; i<=8; i++) printf ": v%d v%d v%d ;\n", i, i-1, i-1;
+    print "v8";
+}' > "$TMP/wide.fth"
+
+# call: a z80 loop decrementing BC from 0xffff down to 0, called 64 times.
+# LD BC,0xffff / DEC BC / LD A,B / OR C / JR NZ,-5 / RET
+awk 'BEGIN {
+    print "create zl 0x01 C, 0xff C, 0xff C, 0x0b C, 0x78 C, 0xb1 C,";
+    print "0x20 C, 0xfb C, 0xc9 C,";
+    print ": c0 zl call ;";
+    for (i=1; i<=6; i++) printf ": c%d c%d c%d ;\n", i, i-1, i-1;
+    print "c6";
+}' > "$TMP/call.fth"
+
+# loadf: 200000 lines to tokenize and interpret.
+awk 'BEGIN { for (i=0; i<200000; i++) print "1 drop"; }' > "$TMP/large.fth"
+
+# Benchmarks
+
+bench startup ./forth "bye"
+for n in 10 100 1000; do
+    bench find_$n ./forth "loadf $TMP/find$n.fth"
+done
+bench execute_deep ./forth "loadf $TMP/deep.fth"
+bench execute_wide ./forth "loadf $TMP/wide.fth"
+bench call_loop ./forth "loadf $TMP/call.fth"
+bench loadf_large ./forth "loadf $TMP/large.fth"
+bench zasm_routines ./zasm.sh z80/routines.fth
+bench zasm_batch ./fth2c.sh z80/*.fth
+
+# Results, one per line, in a stable order.
+
+awk 'BEGIN { print "{" }
+    { lines[NR] = sprintf("  \"%s\": %.3f", $1, $2 / 1000) }
+    END {
+        for (i=1; i<=NR; i++) print lines[i] (i < NR ? "," : "");
+        print "}";
+    }' "$TMP/results" > "$OUT"
+cat "$OUT"
+
+if [ -z "$BASELINE" ]; then
+    exit 0
+fi
+
+# Both files have the format we write above.
+sed -n 's/^ *"\([^"]*\)": \([0-9.]*\),*$/\1 \2/p' "$BASELINE" > "$TMP/base"
+sed -n 's/^ *"\([^"]*\)": \([0-9.]*\),*$/\1 \2/p' "$OUT" > "$TMP/new"
+awk -v tol="$TOLERANCE" '
+    NR == FNR { base[$1] = $2; next }
+    ($1 in base) {
+        ratio = (base[$1] > 0) ? $2 / base[$1] : 1;
+        flag = (ratio > 1 + tol / 100) ? " SLOWER" : "";
+        if (flag != "") slower = 1;
+        printf "%-16s %10.3f %10.3f %6.2fx%s\n", $1, base[$1], $2, ratio, flag;
+    }
+    END { exit slower }' "$TMP/base" "$TMP/new"
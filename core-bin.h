@@ -0,0 +1,110 @@
+// This file is generated by script, but also commited in git
+// because it's a bootstrap requirement.
+
+// : allot here @ + here ! ;
+static void core_0(Forth *f)
+{
+    runz80(f, f->corerefs[0]+ENTRY_FIELD_DATA);
+    if (_quitting(f)) return;
+    runprim(f, 6);
+    if (_quitting(f)) return;
+    runprim(f, 0);
+    if (_quitting(f)) return;
+    runz80(f, f->corerefs[0]+ENTRY_FIELD_DATA);
+    if (_quitting(f)) return;
+    runprim(f, 5);
+}
+
+// : variable create 2 allot ;
+static void core_1(Forth *f)
+{
+    call_native(f, 6);
+    if (_quitting(f)) return;
+    push(f, 0x0002);
+    if (_quitting(f)) return;
+    core_0(f);
+}
+
+// : ? @ . ;
+static void core_2(Forth *f)
+{
+    runprim(f, 6);
+    if (_quitting(f)) return;
+    call_native(f, 1);
+}
+
+// : , here @ ! 2 allot ;
+static void core_3(Forth *f)
+{
+    runz80(f, f->corerefs[0]+ENTRY_FIELD_DATA);
+    if (_quitting(f)) return;
+    runprim(f, 6);
+    if (_quitting(f)) return;
+    runprim(f, 5);
+    if (_quitting(f)) return;
+    push(f, 0x0002);
+    if (_quitting(f)) return;
+    core_0(f);
+}
+
+// : C, here @ C! 1 allot ;
+static void core_4(Forth *f)
+{
+    runz80(f, f->corerefs[0]+ENTRY_FIELD_DATA);
+    if (_quitting(f)) return;
+    runprim(f, 6);
+    if (_quitting(f)) return;
+    runprim(f, 3);
+    if (_quitting(f)) return;
+    push(f, 0x0001);
+    if (_quitting(f)) return;
+    core_0(f);
+}
+
+// : splitb dup 8 rshift swap 255 and ;
+static void core_5(Forth *f)
+{
+    runprim(f, 2);
+    if (_quitting(f)) return;
+    push(f, 0x0008);
+    if (_quitting(f)) return;
+    call_native(f, 15);
+    if (_quitting(f)) return;
+    runprim(f, 1);
+    if (_quitting(f)) return;
+    push(f, 0x00ff);
+    if (_quitting(f)) return;
+    call_native(f, 12);
+}
+
+// : +! dup rot rot @ + swap ! ;
+static void core_6(Forth *f)
+{
+    runprim(f, 2);
+    if (_quitting(f)) return;
+    runprim(f, 8);
+    if (_quitting(f)) return;
+    runprim(f, 8);
+    if (_quitting(f)) return;
+    runprim(f, 6);
+    if (_quitting(f)) return;
+    runprim(f, 0);
+    if (_quitting(f)) return;
+    runprim(f, 1);
+    if (_quitting(f)) return;
+    runprim(f, 5);
+}
+
+// : +1! 1 swap +! ;
+static void core_7(Forth *f)
+{
+    push(f, 0x0001);
+    if (_quitting(f)) return;
+    runprim(f, 1);
+    if (_quitting(f)) return;
+    core_6(f);
+}
+
+#define CORE_FUNCS core_0, core_1, core_2, core_3, core_4, core_5, core_6, core_7
+#define CORE_NAMES "allot", "variable", "?", ",", "C,", "splitb", "+!", "+1!"
+#define CORE_REFS "here"
@@ -0,0 +1,6 @@
+#!/bin/sh
+
+echo "// This file is generated by script, but also commited in git"
+echo "// because it's a bootstrap requirement."
+
+./forth -c "$1"
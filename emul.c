@@ -1,80 +1,1039 @@
+#define _GNU_SOURCE // memfd_create()
+#include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "emul.h"
 
-static Machine m;
+/* Machine images
 
-static uint8_t io_read(int unused, uint16_t addr)
+An image is a header of IMAGE_HEADER_SIZE bytes followed by the 64K of
+memory, as is, so that loading an image is a mmap and a copy. The header
+contains, little endian:
+
+- 6b magic "CFIMG", NUL terminated
+- 1b version
+- 1b unused
+- 14b AF BC DE HL IX IY SP
+- 14b same, for alternate registers
+- 2b PC
+- 2b ramstart
+- 2b minsp
+- 6b R I IFF1 IFF2 IM halted
+- 8b bank window address and size, bank count, selected bank (version 2)
+- rest is unused
+
+The memory is followed by the content of the banks, if any. Version 1 images,
+which have no bank fields, can still be loaded.
+
+I/O handlers aren't part of the image. They're for the host to set up.
+
+A diff, made by emul_savediff(), has the same header with the "CFDIF" magic,
+followed by a bitmap of the pages it contains, a bit per page (see
+emul_isdirty()) with page 0 as the low bit of the first byte, then the content
+of those pages in order.
+*/
+#define IMAGE_MAGIC "CFIMG"
+#define DIFF_MAGIC "CFDIF"
+#define IMAGE_VERSION 2
+#define IMAGE_HEADER_SIZE 0x40
+
+/* Translation cache
+
+Instead of having libz80 decode every instruction through memRead, we decode
+straight-line blocks of code once into Uop arrays that we keep in a cache
+indexed by the block's start PC. A block ends after a branch, or before an
+instruction we don't translate (we let libz80 run that one).
+
+We only translate the instructions zasm emits, which is what our routines
+are made of. Writes to memory covered by a cached block, either from the CPU
+or from the host through emul_touch(), invalidate that block.
+*/
+// Number of cached blocks. Must be a power of 2.
+#define TC_SIZE 0x400
+// Maximum number of instructions in a block
+#define TC_MAXOPS 0x20
+
+typedef enum {
+    UOP_NOP,
+    UOP_LDRR, // LD r, r' (a = r, b = r')
+    UOP_LDRN, // LD r, n
+    UOP_LDDDNN, // LD dd, nn
+    UOP_LDHLMM, // LD HL, (nn)
+    UOP_LDMMHL, // LD (nn), HL
+    UOP_EXDEHL,
+    UOP_PUSH, // PUSH qq
+    UOP_POP, // POP qq
+    UOP_INCSS,
+    UOP_DECSS,
+    UOP_ADDHL, // ADD HL, ss
+    UOP_INCR,
+    UOP_DECR,
+    UOP_OUT, // OUT (n), A
+    UOP_IN, // IN A, (n)
+    UOP_SET, // SET b, r (a = b, b = r)
+    UOP_RES, // RES b, r
+    UOP_PUSHIX,
+    UOP_POPIX,
+    UOP_LDIXMM, // LD IX, (nn)
+    UOP_LDMMIX, // LD (nn), IX
+    // Branches. They always end a block.
+    UOP_JP,
+    UOP_JR,
+    UOP_CALL,
+    UOP_RET,
+    UOP_JPHL,
+    UOP_JPIX,
+} UopType;
+
+typedef struct {
+    byte type;
+    byte a;
+    byte b;
+    byte len; // length of the instruction in bytes
+    byte fetches; // number of opcode fetches (prefixes count), for R
+    byte tstates;
+    ushort nn;
+} Uop;
+
+typedef struct {
+    bool valid;
+    ushort start;
+    // Address right after the last translated instruction.
+    ushort end;
+    byte count;
+    Uop ops[TC_MAXOPS];
+} Block;
+
+/* Banks
+
+When there are banks, the memory between bankaddr and bankaddr+banksize is a
+window onto the selected bank. Banks live in the memfd backing mem (see Forks),
+after the 64K, and selecting one maps it at the window, so switching costs a
+mmap whatever the size of the window.
+
+Dirty pages are numbered by where they live: pages of the 64K first, those of
+the window excepted, then pages of banks, bank 0 first.
+*/
+#define MAX_PAGES (EMUL_PAGES + EMUL_MAXBANKS*(EMUL_MAXBANKSIZE/EMUL_PAGE_SIZE))
+
+struct EmulState {
+    // Index of the machine in machines.
+    int index;
+    // File backing mem, -1 for a fork.
+    int memfd;
+    // Machine we were forked from, NULL if we're not a fork.
+    Machine *parent;
+    // Pages written to since the last checkpoint, and since we were forked.
+    byte dirty[MAX_PAGES/8];
+    byte forkdirty[MAX_PAGES/8];
+    // See emul_banks(). banks maps all banks, the window in mem maps the
+    // selected one.
+    ushort bankaddr;
+    ushort banksize;
+    int bankcount;
+    int bank;
+    byte *banks;
+    bool stats_enabled;
+    EmulStats stats;
+    bool tc_enabled;
+    Block tc_blocks[TC_SIZE];
+    // Number of cached blocks covering each address.
+    byte tc_coverage[0x10000];
+    // Block we're currently stepping through, and where we are in it.
+    Block *tc_cur;
+    int tc_curidx;
+    ushort tc_curpc;
+};
+
+/* Machine registry
+
+libz80 callbacks only get an int param to tell which machine they're for, so
+machines are registered in an array which that param indexes. Slots are
+claimed atomically: machines can be created and run from several threads,
+each machine being used by a single thread at a time.
+*/
+#define EMUL_MAXMACHINES 0x400
+static _Atomic(Machine *) machines[EMUL_MAXMACHINES];
+
+static uint8_t io_read(Machine *m, uint16_t addr)
 {
     addr &= 0xff;
-    IORD fn = m.iord[addr];
+    IORD fn = m->iord[addr];
     if (fn != NULL) {
-        return fn();
+        return fn(m);
     } else {
         fprintf(stderr, "Out of bounds I/O read: %d\n", addr);
         return 0;
     }
 }
 
-static void io_write(int unused, uint16_t addr, uint8_t val)
+static void io_write(Machine *m, uint16_t addr, uint8_t val)
 {
     addr &= 0xff;
-    IOWR fn = m.iowr[addr];
+    IOWR fn = m->iowr[addr];
     if (fn != NULL) {
-        fn(val);
+        fn(m, val);
     } else {
         fprintf(stderr, "Out of bounds I/O write: %d / %d (0x%x)\n", addr, val, val);
     }
 }
 
-static uint8_t mem_read(int unused, uint16_t addr)
+static uint8_t z80_ioread(int param, uint16_t addr)
 {
-    return m.mem[addr];
+    return io_read(machines[param], addr);
 }
 
-static void mem_write(int unused, uint16_t addr, uint8_t val)
+static void z80_iowrite(int param, uint16_t addr, uint8_t val)
 {
-    if (addr < m.ramstart) {
+    io_write(machines[param], addr, val);
+}
+
+static uint8_t mem_read(Machine *m, uint16_t addr)
+{
+    if (m->state->stats_enabled) {
+        m->state->stats.reads[addr >> 8]++;
+    }
+    return m->mem[addr];
+}
+
+static void tc_invalidate(Machine *m, ushort addr);
+
+static bool inwindow(Machine *m, ushort addr)
+{
+    EmulState *s = m->state;
+    return (s->bankcount > 0) && (addr >= s->bankaddr) &&
+        (addr - s->bankaddr < s->banksize);
+}
+
+// Number of pages, banks included.
+static int pagecount(Machine *m)
+{
+    return EMUL_PAGES + m->state->bankcount*m->state->banksize/EMUL_PAGE_SIZE;
+}
+
+static int pageof(Machine *m, ushort addr)
+{
+    EmulState *s = m->state;
+    if (inwindow(m, addr)) {
+        unsigned int offset = s->bank*s->banksize + addr - s->bankaddr;
+        return EMUL_PAGES + offset/EMUL_PAGE_SIZE;
+    }
+    return addr / EMUL_PAGE_SIZE;
+}
+
+// Returns where the content of bank is. For a fork, the window is a copy of
+// the selected bank that banks doesn't see.
+static byte* bankmem(Machine *m, int bank)
+{
+    EmulState *s = m->state;
+    if (bank == s->bank) {
+        return &m->mem[s->bankaddr];
+    }
+    return &s->banks[bank*s->banksize];
+}
+
+// Returns where the content of page is.
+static byte* pagemem(Machine *m, int page)
+{
+    if (page < EMUL_PAGES) {
+        return &m->mem[page*EMUL_PAGE_SIZE];
+    }
+    unsigned int offset = (page-EMUL_PAGES)*EMUL_PAGE_SIZE;
+    return bankmem(m, offset/m->state->banksize) + offset%m->state->banksize;
+}
+
+static void markdirty(Machine *m, ushort addr)
+{
+    int page = pageof(m, addr);
+    m->state->dirty[page >> 3] |= 1 << (page & 7);
+    m->state->forkdirty[page >> 3] |= 1 << (page & 7);
+}
+
+static bool isdirty(const byte *bitmap, int page)
+{
+    return bitmap[page >> 3] & (1 << (page & 7));
+}
+
+static void mem_write(Machine *m, uint16_t addr, uint8_t val)
+{
+    if (addr < m->ramstart) {
         fprintf(stderr, "Writing to ROM (%d)!\n", addr);
     }
-    m.mem[addr] = val;
+    if (m->state->stats_enabled) {
+        m->state->stats.writes[addr >> 8]++;
+    }
+    m->mem[addr] = val;
+    markdirty(m, addr);
+    if (m->state->tc_coverage[addr]) {
+        tc_invalidate(m, addr);
+    }
+    if ((m->watch != NULL) && m->watch[addr]) {
+        m->watchhits++;
+    }
+}
+
+static uint8_t z80_memread(int param, uint16_t addr)
+{
+    return mem_read(machines[param], addr);
+}
+
+static void z80_memwrite(int param, uint16_t addr, uint8_t val)
+{
+    mem_write(machines[param], addr, val);
+}
+
+// Translation cache
+
+static void tc_cover(Machine *m, Block *b, int delta)
+{
+    for (ushort a=b->start; a!=b->end; a++) {
+        m->state->tc_coverage[a] += delta;
+    }
+}
+
+static void tc_drop(Machine *m, Block *b)
+{
+    if (b->valid) {
+        tc_cover(m, b, -1);
+        b->valid = false;
+    }
+    if (b == m->state->tc_cur) {
+        m->state->tc_cur = NULL;
+    }
+}
+
+static void tc_flush(Machine *m)
+{
+    for (int i=0; i<TC_SIZE; i++) {
+        tc_drop(m, &m->state->tc_blocks[i]);
+    }
+    m->state->tc_cur = NULL;
+}
+
+// Drop all blocks covering addr
+static void tc_invalidate(Machine *m, ushort addr)
+{
+    for (int i=0; i<TC_SIZE; i++) {
+        Block *b = &m->state->tc_blocks[i];
+        // works even if the block wraps around 0xffff
+        if (b->valid && ((ushort)(addr - b->start) < (ushort)(b->end - b->start))) {
+            tc_drop(m, b);
+        }
+    }
+}
+
+// Decodes instruction at pc in op. Returns false if we don't translate it.
+static bool tc_decode(Machine *m, ushort pc, Uop *op)
+{
+    byte opcode = m->mem[pc];
+    byte y = (opcode >> 3) & 7;
+    byte z = opcode & 7;
+    byte p = y >> 1;
+    op->nn = m->mem[(ushort)(pc+1)] | (m->mem[(ushort)(pc+2)] << 8);
+    op->len = 1;
+    op->fetches = 1;
+    op->a = y;
+    op->b = z;
+    if (opcode == 0x00) {
+        op->type = UOP_NOP;
+        op->tstates = 4;
+    } else if (opcode == 0x76) {
+        // HALT, we let libz80 handle it.
+        return false;
+    } else if ((opcode & 0xc0) == 0x40) {
+        op->type = UOP_LDRR;
+        op->tstates = ((y == 6) || (z == 6)) ? 7 : 4;
+    } else if ((opcode & 0xc7) == 0x06) {
+        op->type = UOP_LDRN;
+        op->b = op->nn & 0xff;
+        op->len = 2;
+        op->tstates = (y == 6) ? 10 : 7;
+    } else if ((opcode & 0xcf) == 0x01) {
+        op->type = UOP_LDDDNN;
+        op->a = p;
+        op->len = 3;
+        op->tstates = 10;
+    } else if (opcode == 0x2a) {
+        op->type = UOP_LDHLMM;
+        op->len = 3;
+        op->tstates = 16;
+    } else if (opcode == 0x22) {
+        op->type = UOP_LDMMHL;
+        op->len = 3;
+        op->tstates = 16;
+    } else if (opcode == 0xeb) {
+        op->type = UOP_EXDEHL;
+        op->tstates = 4;
+    } else if ((opcode & 0xcf) == 0xc5) {
+        op->type = UOP_PUSH;
+        op->a = p;
+        op->tstates = 11;
+    } else if ((opcode & 0xcf) == 0xc1) {
+        op->type = UOP_POP;
+        op->a = p;
+        op->tstates = 10;
+    } else if ((opcode & 0xcf) == 0x03) {
+        op->type = UOP_INCSS;
+        op->a = p;
+        op->tstates = 6;
+    } else if ((opcode & 0xcf) == 0x0b) {
+        op->type = UOP_DECSS;
+        op->a = p;
+        op->tstates = 6;
+    } else if ((opcode & 0xcf) == 0x09) {
+        op->type = UOP_ADDHL;
+        op->a = p;
+        op->tstates = 11;
+    } else if ((opcode & 0xc7) == 0x04) {
+        op->type = UOP_INCR;
+        op->tstates = (y == 6) ? 11 : 4;
+    } else if ((opcode & 0xc7) == 0x05) {
+        op->type = UOP_DECR;
+        op->tstates = (y == 6) ? 11 : 4;
+    } else if (opcode == 0xd3) {
+        op->type = UOP_OUT;
+        op->len = 2;
+        op->tstates = 11;
+    } else if (opcode == 0xdb) {
+        op->type = UOP_IN;
+        op->len = 2;
+        op->tstates = 11;
+    } else if (opcode == 0xcb) {
+        byte cb = op->nn & 0xff;
+        op->a = (cb >> 3) & 7;
+        op->b = cb & 7;
+        op->len = 2;
+        op->fetches = 2;
+        op->tstates = (op->b == 6) ? 15 : 8;
+        if ((cb & 0xc0) == 0xc0) {
+            op->type = UOP_SET;
+        } else if ((cb & 0xc0) == 0x80) {
+            op->type = UOP_RES;
+        } else {
+            return false;
+        }
+    } else if (opcode == 0xdd) {
+        byte op2 = op->nn & 0xff;
+        op->len = 2;
+        op->fetches = 2;
+        if (op2 == 0xe5) {
+            op->type = UOP_PUSHIX;
+            op->tstates = 15;
+        } else if (op2 == 0xe1) {
+            op->type = UOP_POPIX;
+            op->tstates = 14;
+        } else if (op2 == 0xe9) {
+            op->type = UOP_JPIX;
+            op->tstates = 8;
+        } else if ((op2 == 0x2a) || (op2 == 0x22)) {
+            op->type = (op2 == 0x2a) ? UOP_LDIXMM : UOP_LDMMIX;
+            op->nn = m->mem[(ushort)(pc+2)] | (m->mem[(ushort)(pc+3)] << 8);
+            op->len = 4;
+            op->tstates = 20;
+        } else {
+            return false;
+        }
+    } else if (opcode == 0xc3) {
+        op->type = UOP_JP;
+        op->len = 3;
+        op->tstates = 10;
+    } else if (opcode == 0x18) {
+        op->type = UOP_JR;
+        op->len = 2;
+        op->tstates = 12;
+    } else if (opcode == 0xcd) {
+        op->type = UOP_CALL;
+        op->len = 3;
+        op->tstates = 17;
+    } else if (opcode == 0xc9) {
+        op->type = UOP_RET;
+        op->tstates = 10;
+    } else if (opcode == 0xe9) {
+        op->type = UOP_JPHL;
+        op->tstates = 4;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static Block* tc_translate(Machine *m, ushort pc)
+{
+    Block *b = &m->state->tc_blocks[pc & (TC_SIZE-1)];
+    if (b->valid && (b->start == pc)) {
+        return b;
+    }
+    tc_drop(m, b);
+    b->start = pc;
+    b->count = 0;
+    while (b->count < TC_MAXOPS) {
+        Uop *op = &b->ops[b->count];
+        if (!tc_decode(m, pc, op)) {
+            break;
+        }
+        b->count++;
+        pc += op->len;
+        if (op->type >= UOP_JP) {
+            break;
+        }
+    }
+    b->end = pc;
+    // We don't keep empty blocks: what's at their address might become
+    // something we can translate.
+    if (b->count > 0) {
+        b->valid = true;
+        tc_cover(m, b, 1);
+    }
+    return b;
+}
+
+static byte* tc_reg(Machine *m, byte r)
+{
+    switch (r) {
+        case 0: return &m->cpu.R1.br.B;
+        case 1: return &m->cpu.R1.br.C;
+        case 2: return &m->cpu.R1.br.D;
+        case 3: return &m->cpu.R1.br.E;
+        case 4: return &m->cpu.R1.br.H;
+        case 5: return &m->cpu.R1.br.L;
+        default: return &m->cpu.R1.br.A;
+    }
+}
+
+// r is a z80 register index. 6 means (HL).
+static byte tc_getr(Machine *m, byte r)
+{
+    return (r == 6) ? mem_read(m, m->cpu.R1.wr.HL) : *tc_reg(m, r);
+}
+
+static void tc_setr(Machine *m, byte r, byte val)
+{
+    if (r == 6) {
+        mem_write(m, m->cpu.R1.wr.HL, val);
+    } else {
+        *tc_reg(m, r) = val;
+    }
+}
+
+// "ss" and "dd" register pairs. When qq is true, 3 means AF instead of SP.
+static ushort* tc_pair(Machine *m, byte p, bool qq)
+{
+    switch (p) {
+        case 0: return &m->cpu.R1.wr.BC;
+        case 1: return &m->cpu.R1.wr.DE;
+        case 2: return &m->cpu.R1.wr.HL;
+        default: return qq ? &m->cpu.R1.wr.AF : &m->cpu.R1.wr.SP;
+    }
+}
+
+static void cpu_push(Machine *m, ushort val)
+{
+    m->cpu.R1.wr.SP -= 2;
+    mem_write(m, m->cpu.R1.wr.SP, val & 0xff);
+    mem_write(m, m->cpu.R1.wr.SP+1, val >> 8);
+}
+
+static ushort cpu_pop(Machine *m)
+{
+    ushort val = mem_read(m, m->cpu.R1.wr.SP);
+    val |= mem_read(m, m->cpu.R1.wr.SP+1) << 8;
+    m->cpu.R1.wr.SP += 2;
+    return val;
+}
+
+// Flags after INC r or DEC r. Carry is unaffected.
+static void tc_incflags(Machine *m, byte val, bool dec)
+{
+    byte f = (m->cpu.R1.br.F & 0x01) | (val & 0xa8);
+    if (val == 0) f |= 0x40;
+    if (dec) {
+        f |= 0x02;
+        if ((val & 0xf) == 0xf) f |= 0x10;
+        if (val == 0x7f) f |= 0x04;
+    } else {
+        if ((val & 0xf) == 0) f |= 0x10;
+        if (val == 0x80) f |= 0x04;
+    }
+    m->cpu.R1.br.F = f;
+}
+
+// Runs op, which is at the current PC.
+static void tc_exec(Machine *m, Uop *op)
+{
+    ushort pc = m->cpu.PC + op->len;
+    ushort val;
+    unsigned int sum;
+    m->cpu.R = (m->cpu.R & 0x80) | ((m->cpu.R + op->fetches) & 0x7f);
+    m->cpu.tstates += op->tstates;
+    switch (op->type) {
+        case UOP_NOP:
+            break;
+        case UOP_LDRR:
+            tc_setr(m, op->a, tc_getr(m, op->b));
+            break;
+        case UOP_LDRN:
+            tc_setr(m, op->a, op->b);
+            break;
+        case UOP_LDDDNN:
+            *tc_pair(m, op->a, false) = op->nn;
+            break;
+        case UOP_LDHLMM:
+            val = mem_read(m, op->nn);
+            val |= mem_read(m, op->nn+1) << 8;
+            m->cpu.R1.wr.HL = val;
+            break;
+        case UOP_LDMMHL:
+            mem_write(m, op->nn, m->cpu.R1.br.L);
+            mem_write(m, op->nn+1, m->cpu.R1.br.H);
+            break;
+        case UOP_EXDEHL:
+            val = m->cpu.R1.wr.DE;
+            m->cpu.R1.wr.DE = m->cpu.R1.wr.HL;
+            m->cpu.R1.wr.HL = val;
+            break;
+        case UOP_PUSH:
+            cpu_push(m, *tc_pair(m, op->a, true));
+            break;
+        case UOP_POP:
+            *tc_pair(m, op->a, true) = cpu_pop(m);
+            break;
+        case UOP_INCSS:
+            (*tc_pair(m, op->a, false))++;
+            break;
+        case UOP_DECSS:
+            (*tc_pair(m, op->a, false))--;
+            break;
+        case UOP_ADDHL:
+            val = *tc_pair(m, op->a, false);
+            sum = m->cpu.R1.wr.HL + val;
+            m->cpu.R1.br.F = (m->cpu.R1.br.F & 0xc4) | ((sum >> 8) & 0x28);
+            if (((m->cpu.R1.wr.HL & 0xfff) + (val & 0xfff)) & 0x1000) {
+                m->cpu.R1.br.F |= 0x10;
+            }
+            if (sum & 0x10000) {
+                m->cpu.R1.br.F |= 0x01;
+            }
+            m->cpu.R1.wr.HL = sum;
+            break;
+        case UOP_INCR:
+            val = (tc_getr(m, op->a) + 1) & 0xff;
+            tc_setr(m, op->a, val);
+            tc_incflags(m, val, false);
+            break;
+        case UOP_DECR:
+            val = (tc_getr(m, op->a) - 1) & 0xff;
+            tc_setr(m, op->a, val);
+            tc_incflags(m, val, true);
+            break;
+        case UOP_OUT:
+            io_write(m, (m->cpu.R1.br.A << 8) | (op->nn & 0xff), m->cpu.R1.br.A);
+            break;
+        case UOP_IN:
+            m->cpu.R1.br.A = io_read(m, (m->cpu.R1.br.A << 8) | (op->nn & 0xff));
+            break;
+        case UOP_SET:
+            tc_setr(m, op->b, tc_getr(m, op->b) | (1 << op->a));
+            break;
+        case UOP_RES:
+            tc_setr(m, op->b, tc_getr(m, op->b) & ~(1 << op->a));
+            break;
+        case UOP_PUSHIX:
+            cpu_push(m, m->cpu.R1.wr.IX);
+            break;
+        case UOP_POPIX:
+            m->cpu.R1.wr.IX = cpu_pop(m);
+            break;
+        case UOP_LDIXMM:
+            val = mem_read(m, op->nn);
+            val |= mem_read(m, op->nn+1) << 8;
+            m->cpu.R1.wr.IX = val;
+            break;
+        case UOP_LDMMIX:
+            mem_write(m, op->nn, m->cpu.R1.wr.IX & 0xff);
+            mem_write(m, op->nn+1, m->cpu.R1.wr.IX >> 8);
+            break;
+        case UOP_JP:
+            pc = op->nn;
+            break;
+        case UOP_JR:
+            pc += (signed char)(op->nn & 0xff);
+            break;
+        case UOP_CALL:
+            cpu_push(m, pc);
+            pc = op->nn;
+            break;
+        case UOP_RET:
+            pc = cpu_pop(m);
+            break;
+        case UOP_JPHL:
+            pc = m->cpu.R1.wr.HL;
+            break;
+        case UOP_JPIX:
+            pc = m->cpu.R1.wr.IX;
+            break;
+    }
+    m->cpu.PC = pc;
+}
+
+// Runs the instruction at PC from the cache. Returns false if it can't, in
+// which case libz80 has to run it.
+static bool tc_step(Machine *m)
+{
+    if ((m->state->tc_cur == NULL) || (m->state->tc_curpc != m->cpu.PC)) {
+        m->state->tc_cur = tc_translate(m, m->cpu.PC);
+        m->state->tc_curidx = 0;
+    }
+    if (m->state->tc_curidx >= m->state->tc_cur->count) {
+        m->state->tc_cur = NULL;
+        return false;
+    }
+    Uop *op = &m->state->tc_cur->ops[m->state->tc_curidx++];
+    tc_exec(m, op);
+    // tc_exec() might have dropped our block. If it didn't, we keep our
+    // position unless we branched.
+    if ((m->state->tc_cur != NULL) && (op->type >= UOP_JP)) {
+        m->state->tc_cur = NULL;
+    }
+    m->state->tc_curpc = m->cpu.PC;
+    return true;
+}
+
+static void update_minsp(Machine *m)
+{
+    ushort newsp = m->cpu.R1.wr.SP;
+    if (newsp != 0 && newsp < m->minsp) {
+        m->minsp = newsp;
+    }
+}
+
+// Runs the block at PC up to its end, or until PC reaches until. Returns false
+// if there's nothing we can translate at PC.
+static bool tc_runblock(Machine *m, ushort until)
+{
+    m->state->tc_cur = NULL;
+    Block *b = tc_translate(m, m->cpu.PC);
+    for (int i=0; i<b->count; i++) {
+        tc_exec(m, &b->ops[i]);
+        update_minsp(m);
+        // The block might have been dropped by a write to itself.
+        if (!b->valid || (m->cpu.PC == until)) {
+            break;
+        }
+    }
+    return b->count > 0;
+}
+
+// Runs one instruction through libz80.
+static void cpu_execute(Machine *m)
+{
+    if (!m->state->stats_enabled) {
+        Z80Execute(&m->cpu);
+        return;
+    }
+    ushort pc = m->cpu.PC;
+    byte op = m->mem[pc];
+    byte op2 = m->mem[(ushort)(pc+1)];
+    m->state->stats.pc[pc]++;
+    m->state->stats.instructions++;
+    switch (op) {
+        case 0xcb: m->state->stats.cbop[op2]++; break;
+        case 0xed: m->state->stats.edop[op2]++; break;
+        case 0xdd: m->state->stats.ddop[op2]++; break;
+        case 0xfd: m->state->stats.fdop[op2]++; break;
+        default: m->state->stats.op[op]++;
+    }
+    unsigned int tstates = m->cpu.tstates;
+    Z80Execute(&m->cpu);
+    m->state->stats.tstates += (unsigned int)(m->cpu.tstates - tstates);
+}
+
+/* Forks
+
+A machine's memory is a shared mapping of a memfd. A fork maps the same memfd
+privately, which costs a mmap: the kernel copies pages only when either side
+writes to them. Writes from the parent would show through in pages the fork
+hasn't written to yet, so the parent has to stay untouched while it has a
+fork.
+*/
+
+// Allocates and registers a machine, without memory.
+static Machine* newmachine()
+{
+    Machine *m = calloc(1, sizeof(Machine));
+    if (m == NULL) {
+        return NULL;
+    }
+    m->state = calloc(1, sizeof(EmulState));
+    if (m->state == NULL) {
+        free(m);
+        return NULL;
+    }
+    int index = 0;
+    while (index < EMUL_MAXMACHINES) {
+        Machine *expected = NULL;
+        if (atomic_compare_exchange_strong(&machines[index], &expected, m)) {
+            break;
+        }
+        index++;
+    }
+    if (index == EMUL_MAXMACHINES) {
+        free(m->state);
+        free(m);
+        return NULL;
+    }
+    m->state->index = index;
+    m->state->memfd = -1;
+    m->state->tc_enabled = true;
+    return m;
+}
+
+// Points libz80's callbacks to m. Must be done again after copying cpu.
+static void setcallbacks(Machine *m)
+{
+    m->cpu.memRead = z80_memread;
+    m->cpu.memWrite = z80_memwrite;
+    m->cpu.memParam = m->state->index;
+    m->cpu.ioRead = z80_ioread;
+    m->cpu.ioWrite = z80_iowrite;
+    m->cpu.ioParam = m->state->index;
 }
 
 Machine* emul_init()
 {
-    memset(m.mem, 0, 0x10000);
-    m.ramstart = 0;
-    m.minsp = 0xffff;
-    for (int i=0; i<0x100; i++) {
-        m.iord[i] = NULL;
-        m.iowr[i] = NULL;
+    Machine *m = newmachine();
+    if (m == NULL) {
+        return NULL;
+    }
+    int fd = memfd_create("machine", 0);
+    if ((fd >= 0) && (ftruncate(fd, 0x10000) == 0)) {
+        m->mem = mmap(NULL, 0x10000, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    } else {
+        m->mem = MAP_FAILED;
     }
-    Z80RESET(&m.cpu);
-    m.cpu.memRead = mem_read;
-    m.cpu.memWrite = mem_write;
-    m.cpu.ioRead = io_read;
-    m.cpu.ioWrite = io_write;
-    return &m;
+    if (m->mem == MAP_FAILED) {
+        if (fd >= 0) close(fd);
+        m->mem = NULL;
+        emul_free(m);
+        return NULL;
+    }
+    m->state->memfd = fd;
+    m->ramstart = 0;
+    m->minsp = 0xffff;
+    Z80RESET(&m->cpu);
+    setcallbacks(m);
+    return m;
 }
 
+// Maps the selected bank of m's parent at m's window. Private for a fork.
+static bool mapwindow(Machine *m)
+{
+    EmulState *s = m->state;
+    int fd = s->memfd;
+    int flags = MAP_SHARED|MAP_FIXED;
+    if (s->parent != NULL) {
+        fd = s->parent->state->memfd;
+        flags = MAP_PRIVATE|MAP_FIXED;
+    }
+    byte *window = mmap(&m->mem[s->bankaddr], s->banksize,
+        PROT_READ|PROT_WRITE, flags, fd, 0x10000 + s->bank*s->banksize);
+    return window != MAP_FAILED;
+}
 
-bool emul_step()
+// Gives child the banks of m, copy-on-write.
+static bool forkbanks(Machine *child, Machine *m)
 {
-    if (!m.cpu.halted) {
-        Z80Execute(&m.cpu);
-        ushort newsp = m.cpu.R1.wr.SP;
-        if (newsp != 0 && newsp < m.minsp) {
-            m.minsp = newsp;
+    EmulState *s = child->state;
+    s->bankaddr = m->state->bankaddr;
+    s->banksize = m->state->banksize;
+    s->bank = m->state->bank;
+    s->banks = mmap(NULL, m->state->bankcount*s->banksize,
+        PROT_READ|PROT_WRITE, MAP_PRIVATE, m->state->memfd, 0x10000);
+    if (s->banks == MAP_FAILED) {
+        s->banks = NULL;
+        return false;
+    }
+    s->bankcount = m->state->bankcount;
+    return mapwindow(child);
+}
+
+static void tc_forget(Machine *m, ushort addr, unsigned int len);
+
+bool emul_banks(Machine *m, ushort addr, ushort size, int count)
+{
+    EmulState *s = m->state;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    if ((s->memfd < 0) || (count < 0) || (count > EMUL_MAXBANKS)) {
+        return false;
+    }
+    if ((count > 0) && ((size == 0) || (size > EMUL_MAXBANKSIZE) ||
+        (addr % pagesize) || (size % pagesize) || (addr+size > 0x10000))) {
+        return false;
+    }
+    byte *window = malloc(EMUL_MAXBANKSIZE);
+    if (s->bankcount > 0) {
+        // What the window shows goes back to the unbanked memory.
+        memcpy(window, &m->mem[s->bankaddr], s->banksize);
+        mmap(&m->mem[s->bankaddr], s->banksize, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_FIXED, s->memfd, s->bankaddr);
+        memcpy(&m->mem[s->bankaddr], window, s->banksize);
+        tc_forget(m, s->bankaddr, s->banksize);
+        munmap(s->banks, s->bankcount*s->banksize);
+        s->banks = NULL;
+        s->bankcount = 0;
+    }
+    bool ok = true;
+    if (count > 0) {
+        ok = ftruncate(s->memfd, 0x10000 + count*size) == 0;
+        if (ok) {
+            s->banks = mmap(NULL, count*size, PROT_READ|PROT_WRITE, MAP_SHARED,
+                s->memfd, 0x10000);
+            ok = s->banks != MAP_FAILED;
+        }
+        if (ok) {
+            // Bank 0 starts with what the window showed.
+            memcpy(s->banks, &m->mem[addr], size);
+            s->bankaddr = addr;
+            s->banksize = size;
+            s->bankcount = count;
+            s->bank = 0;
+            ok = mapwindow(m);
+            tc_forget(m, addr, size);
+        } else {
+            s->banks = NULL;
         }
+    }
+    free(window);
+    // Pages are now numbered differently.
+    memset(s->dirty, 0xff, sizeof(s->dirty));
+    memset(s->forkdirty, 0xff, sizeof(s->forkdirty));
+    return ok;
+}
+
+bool emul_bank(Machine *m, int bank)
+{
+    EmulState *s = m->state;
+    if ((bank < 0) || (bank >= s->bankcount)) {
+        return false;
+    }
+    if (bank == s->bank) {
+        return true;
+    }
+    if (s->memfd < 0) {
+        // Our window is a private copy that we'd lose.
+        return false;
+    }
+    s->bank = bank;
+    tc_forget(m, s->bankaddr, s->banksize);
+    return mapwindow(m);
+}
+
+int emul_curbank(Machine *m)
+{
+    return (m->state->bankcount > 0) ? m->state->bank : -1;
+}
+
+Machine* emul_fork(Machine *m)
+{
+    if (m->state->memfd < 0) {
+        return NULL;
+    }
+    Machine *child = newmachine();
+    if (child == NULL) {
+        return NULL;
+    }
+    child->mem = mmap(NULL, 0x10000, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+        m->state->memfd, 0);
+    if (child->mem == MAP_FAILED) {
+        child->mem = NULL;
+        emul_free(child);
+        return NULL;
+    }
+    child->state->parent = m;
+    if ((m->state->bankcount > 0) && !forkbanks(child, m)) {
+        emul_free(child);
+        return NULL;
+    }
+    child->state->tc_enabled = m->state->tc_enabled;
+    memcpy(child->state->dirty, m->state->dirty, sizeof(m->state->dirty));
+    child->cpu = m->cpu;
+    setcallbacks(child);
+    child->ramstart = m->ramstart;
+    child->minsp = m->minsp;
+    memcpy(child->iord, m->iord, sizeof(m->iord));
+    memcpy(child->iowr, m->iowr, sizeof(m->iowr));
+    child->hostctx = m->hostctx;
+    child->watch = m->watch;
+    child->watchhits = m->watchhits;
+    return child;
+}
+
+Machine* emul_commit(Machine *child)
+{
+    Machine *m = child->state->parent;
+    // Pages the child didn't write to are still those of m.
+    for (int page=0; page<pagecount(child); page++) {
+        if (isdirty(child->state->forkdirty, page)) {
+            memcpy(pagemem(m, page), pagemem(child, page), EMUL_PAGE_SIZE);
+        }
+    }
+    tc_flush(m);
+    memcpy(m->state->dirty, child->state->dirty, sizeof(m->state->dirty));
+    m->cpu = child->cpu;
+    setcallbacks(m);
+    m->ramstart = child->ramstart;
+    m->minsp = child->minsp;
+    m->watchhits = child->watchhits;
+    emul_free(child);
+    return m;
+}
+
+Machine* emul_discard(Machine *child)
+{
+    Machine *m = child->state->parent;
+    emul_free(child);
+    return m;
+}
+
+void emul_free(Machine *m)
+{
+    machines[m->state->index] = NULL;
+    if (m->mem != NULL) {
+        munmap(m->mem, 0x10000);
+    }
+    if (m->state->banks != NULL) {
+        munmap(m->state->banks, m->state->bankcount*m->state->banksize);
+    }
+    if (m->state->memfd >= 0) {
+        close(m->state->memfd);
+    }
+    free(m->state);
+    free(m);
+}
+
+
+bool emul_step(Machine *m)
+{
+    if (!m->cpu.halted) {
+        // Pending interrupts are for libz80 to handle.
+        if (!m->state->tc_enabled || m->state->stats_enabled ||
+            m->cpu.nmi_req || m->cpu.int_req || !tc_step(m)) {
+            cpu_execute(m);
+        }
+        update_minsp(m);
         return true;
     } else {
         return false;
     }
 }
 
-bool emul_steps(unsigned int steps)
+bool emul_steps(Machine *m, unsigned int steps)
 {
     while (steps) {
-        if (!emul_step()) {
+        if (!emul_step(m)) {
             return false;
         }
         steps--;
@@ -82,13 +1041,311 @@ bool emul_steps(unsigned int steps)
     return true;
 }
 
-void emul_loop()
+void emul_loop(Machine *m)
+{
+    m->cpu.halted = 0;
+    while (emul_step(m));
+}
+
+bool emul_runto(Machine *m, ushort addr)
+{
+    while (m->cpu.PC != addr) {
+        if (m->cpu.halted) {
+            return false;
+        }
+        // Pending interrupts are for libz80 to handle.
+        if (!m->state->tc_enabled || m->state->stats_enabled ||
+            m->cpu.nmi_req || m->cpu.int_req || !tc_runblock(m, addr)) {
+            cpu_execute(m);
+            update_minsp(m);
+        }
+    }
+    return true;
+}
+
+bool emul_call(Machine *m, ushort addr, ushort retaddr)
+{
+    m->cpu.halted = 0;
+    cpu_push(m, retaddr);
+    update_minsp(m);
+    ushort sp = m->cpu.R1.wr.SP;
+    m->cpu.PC = addr;
+    if (!emul_runto(m, retaddr)) {
+        // The routine halted instead of returning. If it left the stack as
+        // it found it, we take our return address back.
+        if (m->cpu.R1.wr.SP == sp) {
+            m->cpu.R1.wr.SP += 2;
+        }
+        return false;
+    }
+    return true;
+}
+
+static void image_putw(byte *buf, ushort val)
+{
+    buf[0] = val & 0xff;
+    buf[1] = val >> 8;
+}
+
+static ushort image_getw(const byte *buf)
+{
+    return buf[0] | (buf[1] << 8);
+}
+
+static void image_putheader(Machine *m, byte *header, const char *magic)
+{
+    memset(header, 0, IMAGE_HEADER_SIZE);
+    memcpy(header, magic, sizeof(IMAGE_MAGIC));
+    header[6] = IMAGE_VERSION;
+    ushort *regs = &m->cpu.R1.wr.AF;
+    ushort *altregs = &m->cpu.R2.wr.AF;
+    for (int i=0; i<7; i++) {
+        image_putw(&header[8+i*2], regs[i]);
+        image_putw(&header[22+i*2], altregs[i]);
+    }
+    image_putw(&header[36], m->cpu.PC);
+    image_putw(&header[38], m->ramstart);
+    image_putw(&header[40], m->minsp);
+    header[42] = m->cpu.R;
+    header[43] = m->cpu.I;
+    header[44] = m->cpu.IFF1;
+    header[45] = m->cpu.IFF2;
+    header[46] = m->cpu.IM;
+    header[47] = m->cpu.halted;
+    image_putw(&header[48], m->state->bankaddr);
+    image_putw(&header[50], m->state->banksize);
+    image_putw(&header[52], m->state->bankcount);
+    image_putw(&header[54], m->state->bank);
+}
+
+static void image_getheader(Machine *m, const byte *image)
+{
+    ushort *regs = &m->cpu.R1.wr.AF;
+    ushort *altregs = &m->cpu.R2.wr.AF;
+    for (int i=0; i<7; i++) {
+        regs[i] = image_getw(&image[8+i*2]);
+        altregs[i] = image_getw(&image[22+i*2]);
+    }
+    m->cpu.PC = image_getw(&image[36]);
+    m->ramstart = image_getw(&image[38]);
+    m->minsp = image_getw(&image[40]);
+    m->cpu.R = image[42];
+    m->cpu.I = image[43];
+    m->cpu.IFF1 = image[44];
+    m->cpu.IFF2 = image[45];
+    m->cpu.IM = image[46];
+    m->cpu.halted = image[47];
+}
+
+// Number of banks in the image having that header.
+static int image_bankcount(const byte *header)
+{
+    return (header[6] >= 2) ? image_getw(&header[52]) : 0;
+}
+
+// Maps the file at path if it begins with a header with magic. Returns NULL
+// otherwise. Its size goes in size.
+static byte* image_map(const char *path, const char *magic, size_t *size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size < IMAGE_HEADER_SIZE)) {
+        close(fd);
+        return NULL;
+    }
+    *size = st.st_size;
+    byte *image = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return NULL;
+    }
+    if ((memcmp(image, magic, sizeof(IMAGE_MAGIC)) != 0) ||
+        (image[6] < 1) || (image[6] > IMAGE_VERSION)) {
+        munmap(image, *size);
+        return NULL;
+    }
+    return image;
+}
+
+bool emul_save(Machine *m, const char *path)
+{
+    byte header[IMAGE_HEADER_SIZE];
+    image_putheader(m, header, IMAGE_MAGIC);
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        return false;
+    }
+    bool ok = (fwrite(header, IMAGE_HEADER_SIZE, 1, fp) == 1) &&
+        (fwrite(m->mem, 0x10000, 1, fp) == 1);
+    for (int i=0; ok && (i<m->state->bankcount); i++) {
+        ok = fwrite(bankmem(m, i), m->state->banksize, 1, fp) == 1;
+    }
+    return (fclose(fp) == 0) && ok;
+}
+
+bool emul_load(Machine *m, const char *path)
+{
+    size_t size;
+    byte *image = image_map(path, IMAGE_MAGIC, &size);
+    if (image == NULL) {
+        return false;
+    }
+    int count = image_bankcount(image);
+    ushort banksize = (count > 0) ? image_getw(&image[50]) : 0;
+    bool ok = (size == IMAGE_HEADER_SIZE + 0x10000 + count*banksize) &&
+        ((count == 0) || (image_getw(&image[54]) < count));
+    if (ok && ((count != m->state->bankcount) ||
+        (count && ((image_getw(&image[48]) != m->state->bankaddr) ||
+        (banksize != m->state->banksize))))) {
+        ok = emul_banks(m, image_getw(&image[48]), banksize, count);
+    }
+    if (ok && (count > 0)) {
+        ok = emul_bank(m, image_getw(&image[54]));
+    }
+    if (!ok) {
+        munmap(image, size);
+        return false;
+    }
+    memcpy(m->mem, &image[IMAGE_HEADER_SIZE], 0x10000);
+    for (int i=0; i<count; i++) {
+        memcpy(bankmem(m, i), &image[IMAGE_HEADER_SIZE+0x10000+i*banksize],
+            banksize);
+    }
+    image_getheader(m, image);
+    munmap(image, size);
+    memset(m->state->dirty, 0xff, sizeof(m->state->dirty));
+    memset(m->state->forkdirty, 0xff, sizeof(m->state->forkdirty));
+    tc_flush(m);
+    return true;
+}
+
+void emul_checkpoint(Machine *m)
+{
+    memset(m->state->dirty, 0, sizeof(m->state->dirty));
+}
+
+bool emul_isdirty(Machine *m, int page)
+{
+    return isdirty(m->state->dirty, page);
+}
+
+bool emul_savediff(Machine *m, const char *path)
+{
+    byte header[IMAGE_HEADER_SIZE];
+    image_putheader(m, header, DIFF_MAGIC);
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        return false;
+    }
+    int count = pagecount(m);
+    bool ok = (fwrite(header, IMAGE_HEADER_SIZE, 1, fp) == 1) &&
+        (fwrite(m->state->dirty, count/8, 1, fp) == 1);
+    for (int page=0; ok && (page<count); page++) {
+        if (isdirty(m->state->dirty, page)) {
+            ok = fwrite(pagemem(m, page), EMUL_PAGE_SIZE, 1, fp) == 1;
+        }
+    }
+    return (fclose(fp) == 0) && ok;
+}
+
+bool emul_loaddiff(Machine *m, const char *path)
+{
+    size_t size;
+    byte *image = image_map(path, DIFF_MAGIC, &size);
+    if (image == NULL) {
+        return false;
+    }
+    // Page numbers only mean the same thing with the same banks.
+    EmulState *s = m->state;
+    int count = pagecount(m);
+    bool ok = (image_bankcount(image) == s->bankcount) &&
+        ((s->bankcount == 0) || ((image_getw(&image[48]) == s->bankaddr) &&
+        (image_getw(&image[50]) == s->banksize))) &&
+        (size >= IMAGE_HEADER_SIZE + count/8);
+    const byte *bitmap = &image[IMAGE_HEADER_SIZE];
+    int dirtycount = 0;
+    for (int page=0; ok && (page<count); page++) {
+        if (isdirty(bitmap, page)) {
+            dirtycount++;
+        }
+    }
+    ok = ok && (size == IMAGE_HEADER_SIZE + count/8 + dirtycount*EMUL_PAGE_SIZE);
+    if (ok && (s->bankcount > 0)) {
+        ok = emul_bank(m, image_getw(&image[54]));
+    }
+    if (!ok) {
+        munmap(image, size);
+        return false;
+    }
+    const byte *src = &image[IMAGE_HEADER_SIZE + count/8];
+    for (int page=0; page<count; page++) {
+        if (isdirty(bitmap, page)) {
+            memcpy(pagemem(m, page), src, EMUL_PAGE_SIZE);
+            s->dirty[page >> 3] |= 1 << (page & 7);
+            s->forkdirty[page >> 3] |= 1 << (page & 7);
+            src += EMUL_PAGE_SIZE;
+        }
+    }
+    tc_flush(m);
+    image_getheader(m, image);
+    munmap(image, size);
+    return true;
+}
+
+static void tc_forget(Machine *m, ushort addr, unsigned int len)
+{
+    while (len--) {
+        if (m->state->tc_coverage[addr]) {
+            tc_invalidate(m, addr);
+        }
+        addr++;
+    }
+}
+
+void emul_touch(Machine *m, ushort addr, unsigned int len)
+{
+    // Pages are aligned, so we mark one every EMUL_PAGE_SIZE bytes, plus the
+    // last one.
+    for (unsigned int i=0; i<len; i+=EMUL_PAGE_SIZE) {
+        markdirty(m, addr+i);
+    }
+    if (len > 0) {
+        markdirty(m, addr+len-1);
+    }
+    tc_forget(m, addr, len);
+    if (m->watch != NULL) {
+        for (unsigned int i=0; i<len; i++) {
+            if (m->watch[(ushort)(addr+i)]) {
+                m->watchhits++;
+                break;
+            }
+        }
+    }
+}
+
+void emul_tcache(Machine *m, bool enabled)
+{
+    tc_flush(m);
+    m->state->tc_enabled = enabled;
+}
+
+void emul_stats(Machine *m, bool enabled)
+{
+    if (enabled) {
+        memset(&m->state->stats, 0, sizeof(EmulStats));
+    }
+    m->state->stats_enabled = enabled;
+}
+
+EmulStats* emul_getstats(Machine *m)
 {
-    m.cpu.halted = 0;
-    while (emul_step());
+    return &m->state->stats;
 }
 
-void emul_printdebug()
+void emul_printdebug(Machine *m)
 {
-    fprintf(stderr, "Min SP: %04x\n", m.minsp);
+    fprintf(stderr, "Min SP: %04x\n", m->minsp);
 }
@@ -3,12 +3,23 @@
 #include <stdbool.h>
 #include "libz80/z80.h"
 
-typedef byte (*IORD) ();
-typedef void (*IOWR) (byte data);
+// Dirty memory is tracked by pages of that size.
+#define EMUL_PAGE_SIZE 0x100
+#define EMUL_PAGES (0x10000 / EMUL_PAGE_SIZE)
+#define EMUL_MAXBANKS 0x100
+#define EMUL_MAXBANKSIZE 0x8000
 
-typedef struct {
+typedef struct Machine Machine;
+typedef byte (*IORD) (Machine *m);
+typedef void (*IOWR) (Machine *m, byte data);
+
+// Emulator internals: translation cache, counters.
+typedef struct EmulState EmulState;
+
+struct Machine {
     Z80Context cpu;
-    byte mem[0x10000];
+    // 64K, mapped by emul_init().
+    byte *mem;
     // Set to non-zero to specify where ROM ends. Any memory write attempt
     // below ramstart will trigger a warning.
     ushort ramstart;
@@ -18,7 +29,34 @@ typedef struct {
     // NULL when IO port is unhandled.
     IORD iord[0x100];
     IOWR iowr[0x100];
-} Machine;
+    // For the host to find its own context from I/O handlers.
+    void *hostctx;
+    // Map of 0x10000 flags owned by the host, NULL for none. Writes to a
+    // flagged address, by the CPU or through emul_touch(), increment
+    // watchhits. Forks share the map of their parent.
+    byte *watch;
+    unsigned int watchhits;
+    EmulState *state;
+};
+
+// Counters updated by emul_step() and emul_runto() when enabled with
+// emul_stats().
+typedef struct {
+    // Number of instructions run at each address.
+    uint64_t pc[0x10000];
+    // Opcode histograms. Prefixed opcodes are counted by their second byte in
+    // the table of their prefix.
+    uint64_t op[0x100];
+    uint64_t cbop[0x100];
+    uint64_t edop[0x100];
+    uint64_t ddop[0x100];
+    uint64_t fdop[0x100];
+    uint64_t instructions;
+    uint64_t tstates;
+    // Memory accesses per 256 bytes page, opcode fetches included.
+    uint64_t reads[0x100];
+    uint64_t writes[0x100];
+} EmulStats;
 
 typedef enum {
     TRI_HIGH,
@@ -26,8 +64,63 @@ typedef enum {
     TRI_HIGHZ
 } Tristate;
 
+// Creates a new machine. Machines are independent from each other and can each
+// be run from its own thread. Returns NULL if we can't have more machines.
 Machine* emul_init();
-bool emul_step();
-bool emul_steps(unsigned int steps);
-void emul_loop();
-void emul_printdebug();
+void emul_free(Machine *m);
+// Creates a child of m, sharing its memory copy-on-write, which makes it
+// cheap. m mustn't run or be written to until the child is committed or
+// discarded. A child can't be forked. Returns NULL on error.
+Machine* emul_fork(Machine *m);
+// Replaces the state of the parent of child with the one of child, frees
+// child and returns the parent.
+Machine* emul_commit(Machine *child);
+// Frees child, leaving its parent as it was, and returns the parent.
+Machine* emul_discard(Machine *child);
+// Makes the size bytes at addr a window onto one of count banks, bank 0 being
+// selected, or removes banks if count is 0. addr and size have to be multiples
+// of the host's page size. What the window shows stays, as bank 0 or as
+// unbanked memory. Returns false on error. Forks can't do that.
+bool emul_banks(Machine *m, ushort addr, ushort size, int count);
+// Selects the bank shown in the window. Returns false if there's no such bank,
+// or if m is a fork, which can only see the bank it was forked with.
+bool emul_bank(Machine *m, int bank);
+// Selected bank, -1 if there are no banks.
+int emul_curbank(Machine *m);
+bool emul_step(Machine *m);
+bool emul_steps(Machine *m, unsigned int steps);
+void emul_loop(Machine *m);
+// Runs until PC reaches addr. Returns false if the CPU halted before.
+bool emul_runto(Machine *m, ushort addr);
+// Calls the routine at addr with retaddr as its return address and runs until
+// it returns, that is until PC reaches retaddr. Nothing else should ever get
+// there. Returns false if the CPU halted before.
+bool emul_call(Machine *m, ushort addr, ushort retaddr);
+// Saves the whole machine state, I/O handlers excepted, to an image file at
+// path. Returns false on error.
+bool emul_save(Machine *m, const char *path);
+// Restores the machine state saved at path by emul_save(). Returns false on
+// error, in which case the machine is untouched.
+bool emul_load(Machine *m, const char *path);
+// Tell the emulator that len bytes at addr were written to by the host. They
+// are then dirty, like memory written to by the CPU.
+void emul_touch(Machine *m, ushort addr, unsigned int len);
+// Enable or disable the translation cache.
+void emul_tcache(Machine *m, bool enabled);
+// Enables (resetting them) or disables counters. While they're enabled, we
+// don't use the translation cache so that all accesses go through libz80.
+void emul_stats(Machine *m, bool enabled);
+EmulStats* emul_getstats(Machine *m);
+void emul_printdebug(Machine *m);
+// Marks all pages clean. Pages written to from then on are dirty.
+void emul_checkpoint(Machine *m);
+// Pages are numbered by where they live: pages of the 64K, with those of the
+// bank window left out, then pages of banks, bank 0 first.
+bool emul_isdirty(Machine *m, int page);
+// Saves registers and dirty pages to a diff file at path. Returns false on
+// error.
+bool emul_savediff(Machine *m, const char *path);
+// Applies the diff saved at path by emul_savediff(), which only makes sense on
+// the state that was checkpointed before saving it. Pages it contains become
+// dirty. Returns false on error, in which case the machine is untouched.
+bool emul_loaddiff(Machine *m, const char *path);
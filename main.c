@@ -1,10 +1,15 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "emul.h"
-#include "core.h"
 #include "z80-bin.h"
 
 #define NAME_LEN 8
@@ -19,7 +24,8 @@ Structure
 
 */
 #define DICT_ADDR 0x3000
-#define DICT_SIZE 0x1000
+// The dictionary stops where the bank window (BANK_ADDR) starts.
+#define DICT_SIZE 0x5000
 // offsets for each field
 #define ENTRY_FIELD_TYPE 0
 #define ENTRY_FIELD_NAME 1
@@ -35,6 +41,9 @@ Structure
 // When reading a word, we place the last read WS in this address so that we
 // can properly detect newlines
 #define LASTWS_ADDR 0x2ffa
+// Last entry forgotten while not being the last of the dictionary, 0 for none.
+// Such entries are chained through their prev field (see compact()).
+#define FORGOTTEN_ADDR 0x2ff8
 
 // Offset where we place currently read word
 #define CURWORD_ADDR 0x2f00
@@ -42,23 +51,63 @@ Structure
 // Offset where binary from z80/routines.fth are placed.
 #define ROUTINES_ADDR 0x1000
 
+// Return address of the z80 code we call, right below the routines. Nothing is
+// loaded there and it's preceded by a HALT, so that code running through the
+// empty memory below, after a JP 0 say, halts before getting there.
+#define RETSTUB_ADDR 0x0fff
+
+// Offset of the block buffers
+#define BLKBUF_ADDR 0x2000
+
+// Return stack of compiled words, growing down from RSTACK_ADDR, between the
+// block buffers and CURWORD.
+#define RSTACK_ADDR 0x2f00
+#define RSTACK_SIZE 0x700
+
 // Whether the parsing of the current line has been aborted and that we need to
 // return to the interpreter
 #define FLAG_QUITTING 0
 
 // Z80 Ports
 #define STDIO_PORT 0x00
-
-typedef void (*Callable) ();
+// Writes BC bytes at HL to the console in a single OUT.
+#define DMA_PORT 0x01
+// Block device, see "Block device" below.
+#define BLK_PORT 0x02
+// OUT selects the bank shown at BANK_ADDR, IN gives the selected one.
+#define BANK_PORT 0x03
+
+// Memory banks, when enabled with the banks word, are seen through a window of
+// BANK_SIZE bytes at BANK_ADDR, between the dictionary and the stack.
+#define BANK_ADDR 0x8000
+#define BANK_SIZE 0x4000
+
+// How z80 primitives having a host-native implementation are run.
+// Run the z80 code in the emulator.
+#define PRIM_EMULATED 0
+// Run the equivalent C implementation.
+#define PRIM_NATIVE 1
+// Run both and verify that they leave the machine in the same state.
+#define PRIM_CHECK 2
+
+typedef struct Forth Forth;
+typedef void (*Callable) (Forth *f);
+
+// z80 code always starts with POP IX (dd e1), so native indexes can go up to
+// there without being mistaken for it.
+#define NATIVE_MAX 0x100
 
 typedef enum {
     // Entry is a compile list of words. arg points to address in heap.
     TYPE_COMPILED = 0,
-    // Entry links to native code. If arg < 0x20, it's an index in native_funcs
-    // Array. Otherwise, it's a code offset to call in z80.
+    // Entry links to native code. If arg < NATIVE_MAX, it's an index in
+    // native_funcs Array. Otherwise, it's a code offset to call in z80.
     TYPE_NATIVE = 1,
     // Entry is a cell, arg holds cell value.
     TYPE_CELL = 2,
+    // Entry is a compiled word made into z80 code by zdefine(). It's called
+    // like a z80 TYPE_NATIVE entry.
+    TYPE_ZCOMPILED = 3,
 } EntryType;
 
 typedef enum {
@@ -73,201 +122,1038 @@ typedef struct {
     int next; // offset of next item
 } HeapItem;
 
+/* Threaded code
+
+Walking the heap of a TYPE_COMPILED entry item by item and re-reading the
+header of every referenced entry is slow. When we define a word, we also
+decode its heap into a host-side array of ThreadItem, which is what
+execute() runs. The heap stays the reference (see, forget, etc. use it), the
+threaded form is only a cache of it.
+*/
+typedef enum {
+    OP_NUM, // push arg
+    OP_CELL, // push arg, the address of the cell
+    OP_NATIVE, // call native_funcs[arg]
+    OP_Z80, // run z80 code at arg
+    OP_PRIM, // run primitive prims[arg]
+    OP_COMPILED, // run threaded code of entry at arg
+    OP_SUPER, // run superinstruction supers[arg], skipping the items it covers
+    OP_EXIT
+} ThreadOp;
+
+typedef struct {
+    ThreadOp op;
+    uint16_t arg;
+    // Offset of the entry this item runs, 0 for literals.
+    uint16_t entry;
+} ThreadItem;
+
+typedef struct ThreadedCode {
+    // Value of dict_gen when this code was decoded.
+    unsigned int gen;
+    // Number of items, OP_EXIT included.
+    int count;
+    // Next code replaced while compiled words ran, see getthreaded().
+    struct ThreadedCode *stale;
+    ThreadItem items[];
+} ThreadedCode;
+
+// A z80 primitive that also has a C implementation acting directly on memory
+// and registers.
+typedef struct {
+    char *name;
+    unsigned char *bin; // z80 code, as given to z80entry()
+    uint16_t binlen;
+    Callable fn;
+} Primitive;
+
+// Maximum number of primitives fused in a superinstruction.
+#define SUPER_MAXLEN 3
+// Maximum number of superinstructions.
+#define SUPER_MAX 0x20
+
+// A sequence of primitives fused in a single entry. That entry's z80 code is
+// the concatenation of theirs.
+typedef struct {
+    uint16_t offset; // offset of the entry
+    int len;
+    int prims[SUPER_MAXLEN]; // indexes in prims
+} Super;
+
 typedef struct {
     uint16_t offset; // offset where it lives.
-    uint16_t next; // set by find() to have a an easy link to next.
     char *name;
     uint16_t prev;
     EntryType type;
     uint16_t arg; // see EntryType comments.
 } DictionaryEntry;
 
-// Whether we should continue running the program
-static bool running = true;
-// Current stream being read.
-FILE *curstream;
+// Number of buckets in the dictionary hash index. Must be a power of 2.
+#define DICT_HASH_SIZE 0x100
+
+/* Input sources
+
+Words are read from an InputSource, a buffer and our position in it. Lines
+given to interpret_line() are scanned in place, files are mmap'd whole and
+stdin is read a line at a time. readword() scans the buffer directly rather
+than going through libc for each character.
+*/
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t pos;
+    // When not NULL, buf is refilled from this stream, a line at a time, when
+    // we reach its end. buf is then owned by getline().
+    FILE *fp;
+    size_t cap;
+} InputSource;
+
+// Maximum number of cells on top of the data stack kept by the host.
+#define TOS_CACHE 4
+
+// Items of the definition being compiled. Can't be more than what fits in the
+// heap.
+#define DEFITEMS_MAX (0x10000 / 3)
+// How deep we go when an inlined body itself calls small compiled words.
+#define INLINE_DEPTH 8
+// Maximum number of primitives
+#define PRIM_MAX 0x10
+// Maximum number of entries translated core words refer to
+#define COREREFS_MAX 0x10
+
+#define CONBUF_SIZE 0x1000
+
+typedef struct {
+    uint64_t count;
+    uint64_t incl; // ns
+    uint64_t excl; // ns
+    uint64_t tstates; // inclusive
+    // Number of frames of this entry on the stack, to avoid counting
+    // recursive calls twice in incl.
+    unsigned int active;
+    char name[NAME_LEN+1];
+} ProfData;
+
+typedef struct {
+    uint16_t offset;
+    uint64_t start;
+    uint64_t children; // ns spent in callees
+    unsigned int tstates;
+} ProfFrame;
+
+#define PROF_DEPTH 0x400
+
+#define BLK_SIZE 1024
+#define BLK_BUFCOUNT 2
+
+typedef struct {
+    int blk; // -1 when unassigned
+    bool dirty;
+    unsigned int used; // value of blkclock when last used
+} BlockBuffer;
+
+/* Interpreter context
 
-static Machine *m;
+All the state of a Forth instance lives in a Forth, which is passed around
+explicitly. Instances are independent: each has its own Machine and they can
+run concurrently in separate threads. Only stdin and stdout are shared.
+*/
+struct Forth {
+    Machine *m;
+    // Machine m was forked from, NULL if we're not running a fork.
+    Machine *parent;
+    // Whether we should continue running the program
+    bool running;
+    // Number of threaded code runs we're in.
+    int rundepth;
+    // Return stack pointer, see run().
+    uint16_t rsp;
+    // Cells on top of the data stack that aren't on the z80 stack yet, oldest
+    // first. See push().
+    uint16_t tos[TOS_CACHE];
+    int toscount;
+    // How many cells we can keep there. 0 unless primitives run natively.
+    int toscap;
+    // Source being read.
+    InputSource *cursrc;
+    InputSource stdinsrc;
+
+    // Offset of the newest entry in each bucket, 0 for empty.
+    uint16_t dict_buckets[DICT_HASH_SIZE];
+    // For each entry offset, offset of the next (older) entry in the same
+    // bucket.
+    uint16_t dict_hashnext[0x10000];
+
+    // Threaded code for each TYPE_COMPILED entry offset, NULL if not decoded
+    // yet.
+    ThreadedCode *threaded[0x10000];
+    // Bumped whenever entries are removed from the dictionary. A new entry
+    // could then take the place of a removed one, making threaded code that
+    // references it stale. Also bumped when the heap items threaded code was
+    // decoded from are written to.
+    unsigned int dict_gen;
+    // Flags the bytes of those heap items, as the machine's watch map. It's
+    // rebuilt as code is decoded again, after dict_gen moved.
+    byte threadmap[0x10000];
+    // dict_gen the marks of threadmap are for.
+    unsigned int mapgen;
+    // Last value of the machine's watchhits we've seen.
+    unsigned int watchhits;
+    // Threaded code replaced while run() might still point into it, freed
+    // once nothing runs.
+    ThreadedCode *stale;
+
+    int primmode;
+    // For each of prims, offset of the entry running its code, 0 if there's
+    // none.
+    uint16_t primoffsets[PRIM_MAX];
+    // Machine states compared in PRIM_CHECK mode, and their memory.
+    Machine checkbefore;
+    Machine checknative;
+    byte checkmem[2][0x10000];
+
+    // Superinstructions we know of, oldest first.
+    Super supers[SUPER_MAX];
+    int supercount;
+    // Whether run() counts the sequences of primitives it runs.
+    bool seqprofiling;
+    uint32_t seqcounts2[PRIM_MAX][PRIM_MAX];
+    uint32_t seqcounts3[PRIM_MAX][PRIM_MAX][PRIM_MAX];
+
+    // Whether define() runs the optimizer on new definitions.
+    bool optimizing;
+    HeapItem defitems[DEFITEMS_MAX];
+    // define() inlines compiled words having at most that many items. 0
+    // disables inlining.
+    int inline_max;
+    // Entries core words use, see bindcore().
+    uint16_t corerefs[COREREFS_MAX];
+    // Whether define() compiles new definitions to z80 code when it can.
+    bool zcompiling;
+
+    char conbuf[CONBUF_SIZE];
+    int conlen;
+
+    bool profiling;
+    // Indexed by entry offset. Allocated when we first start profiling.
+    ProfData *profdata;
+    ProfFrame profstack[PROF_DEPTH];
+    int profdepth;
+    // Frames that didn't fit in profstack.
+    int profoverflow;
+
+    byte *blkmap;
+    unsigned int blkcount;
+    BlockBuffer blkbufs[BLK_BUFCOUNT];
+    unsigned int blkclock;
+    // Buffer update applies to.
+    int blklast;
+    uint8_t blkstatus;
+
+    // Where bytes emitted to STDIO_PORT go while we assemble.
+    byte asmbuf[0x10000];
+    unsigned int asmlen;
+};
 
 // Foward declarations
-static void execute();
-static bool _interpret(char *word);
-static bool interpret();
-void interpret_line(char *line);
-static void call_native(int index);
-static void call();
+static void execute(Forth *f);
+static bool _interpret(Forth *f, char *word);
+static bool interpret(Forth *f);
+static void interpret_line(Forth *f, char *line);
+static void call_native(Forth *f, int index);
+static void call(Forth *f);
+static int findprim(Forth *f, uint16_t offset);
+static void bindprims(Forth *f);
+static void runprim(Forth *f, int index);
+static void bindsupers(Forth *f);
+static int optimize(Forth *f, HeapItem *items, int count);
+static bool zdefine(Forth *f, DictionaryEntry *de, HeapItem *items, int count);
+static uint16_t zheap(Forth *f, uint16_t offset);
+static void zwrite(Forth *f, uint16_t start, uint16_t slot);
+static void bindcore(Forth *f);
+static void countseq(Forth *f, ThreadItem *ti);
+static void runsuper(Forth *f, int index);
+static void z80entry(Forth *f, char *name, unsigned char* bin, uint16_t binlen);
+static void blkdrop(Forth *f);
+static void blkflush(Forth *f);
+static void prunegone(Forth *f);
+static void error(Forth *f, char *msg);
 
 // Internal
 
-static uint16_t readw(uint16_t offset)
+static uint16_t readw(Forth *f, uint16_t offset)
 {
     uint16_t r;
-    r = m->mem[offset];
-    r |= m->mem[offset+1] << 8;
+    r = f->m->mem[offset];
+    r |= f->m->mem[(uint16_t)(offset+1)] << 8;
     return r;
 }
 
-static void writew(uint16_t offset, uint16_t dest)
+// All writes to memory from the host go through writeb() or writew() so that
+// the emulator knows about them.
+static void writeb(Forth *f, uint16_t offset, byte val)
+{
+    f->m->mem[offset] = val;
+    emul_touch(f->m, offset, 1);
+}
+
+static void writew(Forth *f, uint16_t offset, uint16_t dest)
 {
-    m->mem[offset] = dest & 0xff;
-    m->mem[offset+1] = dest >> 8;
+    f->m->mem[offset] = dest & 0xff;
+    f->m->mem[(uint16_t)(offset+1)] = dest >> 8;
+    emul_touch(f->m, offset, 2);
 }
 
-static bool _quitting()
+static bool _quitting(Forth *f)
 {
-    return m->mem[FLAGS_ADDR] & (1 << FLAG_QUITTING);
+    return f->m->mem[FLAGS_ADDR] & (1 << FLAG_QUITTING);
 }
 
-static void _unquit()
+static void _unquit(Forth *f)
 {
-    m->mem[FLAGS_ADDR] &= ~(1 << FLAG_QUITTING);
+    writeb(f, FLAGS_ADDR, f->m->mem[FLAGS_ADDR] & ~(1 << FLAG_QUITTING));
 }
 
-static void readentry(DictionaryEntry *de, uint16_t offset)
+static void readentry(Forth *f, DictionaryEntry *de, uint16_t offset)
 {
     de->offset = offset;
-    de->type = (EntryType)m->mem[offset+ENTRY_FIELD_TYPE];
-    de->name = &m->mem[offset+ENTRY_FIELD_NAME];
-    de->prev = readw(offset+ENTRY_FIELD_PREV);
-    de->arg = readw(offset+ENTRY_FIELD_DATA);
+    de->type = (EntryType)f->m->mem[offset+ENTRY_FIELD_TYPE];
+    de->name = &f->m->mem[offset+ENTRY_FIELD_NAME];
+    de->prev = readw(f, offset+ENTRY_FIELD_PREV);
+    de->arg = readw(f, offset+ENTRY_FIELD_DATA);
+}
+
+/* Dictionary hash index
+
+find() is called for every word we interpret or compile, so we don't want to
+walk the whole "prev" chain for it. We keep, on the host side, a hash table of
+all entries reachable from CURRENT. Each bucket is a list, newest entry first,
+so that the first match is the same as the one the chain walk would give us.
+
+The in-memory dictionary stays the reference: _create(), forget() and the
+rollback in define() keep the index in sync with it.
+*/
+
+// Only the first NAME_LEN chars of a name are significant.
+static uint8_t hashname(const char *name)
+{
+    uint32_t h = 2166136261u; // FNV-1a
+    for (int i=0; (i<NAME_LEN) && name[i]; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return (h ^ (h >> 8) ^ (h >> 16) ^ (h >> 24)) & (DICT_HASH_SIZE-1);
+}
+
+// Add entry at offset to the index. It has to be the newest of its name.
+static void hashadd(Forth *f, uint16_t offset)
+{
+    uint8_t h = hashname(&f->m->mem[offset+ENTRY_FIELD_NAME]);
+    f->dict_hashnext[offset] = f->dict_buckets[h];
+    f->dict_buckets[h] = offset;
+}
+
+static void hashremove(Forth *f, uint16_t offset)
+{
+    uint16_t *link = &f->dict_buckets[hashname(&f->m->mem[offset+ENTRY_FIELD_NAME])];
+    while (*link > 0) {
+        if (*link == offset) {
+            *link = f->dict_hashnext[offset];
+            return;
+        }
+        link = &f->dict_hashnext[*link];
+    }
 }
 
-static DictionaryEntry find(char *word)
+static DictionaryEntry find(Forth *f, char *word)
 {
     DictionaryEntry de;
-    // We purposefully omit the "no entry" case: never happens.
-    de.prev = readw(CURRENT_ADDR);
-    de.offset = readw(HERE_ADDR);
-    de.next = 0;
-    while (de.prev > 0) {
-        de.next = de.offset; // useful for forget()
-        readentry(&de, de.prev);
+    uint16_t offset = f->dict_buckets[hashname(word)];
+    while (offset > 0) {
+        readentry(f, &de, offset);
         if (strncmp(word, de.name, NAME_LEN) == 0) {
             return de;
         }
+        offset = f->dict_hashnext[offset];
     }
     de.offset = 0;
     return de;
 }
 
+// Rebuilds the whole index from the dictionary.
+static void reindex(Forth *f)
+{
+    uint16_t tails[DICT_HASH_SIZE];
+    memset(f->dict_buckets, 0, sizeof(f->dict_buckets));
+    // We walk from newest to oldest, so we append to buckets.
+    uint16_t offset = readw(f, CURRENT_ADDR);
+    while (offset > 0) {
+        uint8_t h = hashname(&f->m->mem[offset+ENTRY_FIELD_NAME]);
+        if (f->dict_buckets[h] == 0) {
+            f->dict_buckets[h] = offset;
+        } else {
+            f->dict_hashnext[tails[h]] = offset;
+        }
+        f->dict_hashnext[offset] = 0;
+        tails[h] = offset;
+        offset = readw(f, offset+ENTRY_FIELD_PREV);
+    }
+}
+
+// Returns the offset of the entry having offset as its "prev", 0 if offset is
+// the last of the chain.
+static uint16_t findnext(Forth *f, uint16_t offset)
+{
+    uint16_t next = 0;
+    uint16_t cur = readw(f, CURRENT_ADDR);
+    while ((cur > 0) && (cur != offset)) {
+        next = cur;
+        cur = readw(f, cur+ENTRY_FIELD_PREV);
+    }
+    return next;
+}
+
+// Whether len bytes at offset fit in the dictionary. Errors out if they don't.
+static bool dictroom(Forth *f, uint16_t offset, int len)
+{
+    if (offset+len > DICT_ADDR+DICT_SIZE) {
+        error(f, "Dictionary full");
+        return false;
+    }
+    return true;
+}
+
 // Creates and returns a new dictionary entry. That entry has its header written
-// to memory.
-static DictionaryEntry _create(char *name, EntryType type, uint16_t extra_allot)
+// to memory, unless it doesn't fit, in which case we error out and leave the
+// dictionary alone.
+static DictionaryEntry _create(Forth *f, char *name, EntryType type, uint16_t extra_allot)
 {
     DictionaryEntry de;
     de.type = type;
     de.name = name;
     de.arg = 0;
-    de.prev = readw(CURRENT_ADDR);
-    de.offset = readw(HERE_ADDR);
-    m->mem[de.offset+ENTRY_FIELD_TYPE] = de.type;
-    strncpy(&m->mem[de.offset+ENTRY_FIELD_NAME], de.name, NAME_LEN);
-    writew(de.offset+ENTRY_FIELD_PREV, de.prev);
-    writew(CURRENT_ADDR, de.offset);
-    writew(HERE_ADDR, de.offset + ENTRY_FIELD_DATA + extra_allot);
+    de.prev = readw(f, CURRENT_ADDR);
+    de.offset = readw(f, HERE_ADDR);
+    if (!dictroom(f, de.offset, ENTRY_FIELD_DATA+extra_allot)) {
+        return de;
+    }
+    writeb(f, de.offset+ENTRY_FIELD_TYPE, de.type);
+    strncpy(&f->m->mem[de.offset+ENTRY_FIELD_NAME], de.name, NAME_LEN);
+    emul_touch(f->m, de.offset+ENTRY_FIELD_NAME, NAME_LEN);
+    writew(f, de.offset+ENTRY_FIELD_PREV, de.prev);
+    writew(f, CURRENT_ADDR, de.offset);
+    writew(f, HERE_ADDR, de.offset + ENTRY_FIELD_DATA + extra_allot);
+    hashadd(f, de.offset);
     return de;
 }
 
-static HeapItem readheap(int offset)
+static HeapItem readheap(Forth *f, int offset)
 {
     HeapItem r;
-    byte val = m->mem[offset];
+    byte val = f->m->mem[offset];
     if (val == 0xff) {
         r.type = TYPE_STOP;
     } else if (val == 0xfe) {
         r.type = TYPE_NUM;
-        r.arg = readw(offset+1);
+        r.arg = readw(f, offset+1);
         r.next = offset+3;
     } else {
         r.type = TYPE_WORD;
-        r.arg = readw(offset+1);
+        r.arg = readw(f, offset+1);
         r.next = offset+3;
     }
     return r;
 }
 
-static void writeheap(HeapItem *hi)
+static void writeheap(Forth *f, HeapItem *hi)
 {
-    uint16_t nextoffset = readw(HERE_ADDR);
+    uint16_t nextoffset = readw(f, HERE_ADDR);
+    if (!dictroom(f, nextoffset, (hi->type == TYPE_STOP) ? 1 : 3)) {
+        return;
+    }
     switch (hi->type) {
         case TYPE_STOP:
-            m->mem[nextoffset++] = 0xff;
+            writeb(f, nextoffset++, 0xff);
             break;
         case TYPE_NUM:
-            m->mem[nextoffset++] = 0xfe;
-            writew(nextoffset, hi->arg);
+            writeb(f, nextoffset++, 0xfe);
+            writew(f, nextoffset, hi->arg);
             nextoffset += 2;
             break;
         case TYPE_WORD:
-            m->mem[nextoffset++] = 0xfd;
-            writew(nextoffset, hi->arg);
+            writeb(f, nextoffset++, 0xfd);
+            writew(f, nextoffset, hi->arg);
             nextoffset += 2;
             break;
     }
-    writew(HERE_ADDR, nextoffset);
+    writew(f, HERE_ADDR, nextoffset);
+}
+
+/* Console
+
+Everything we write to stdout, whether it comes from our words or from z80
+code through STDIO_PORT, goes through a buffer. We flush it at line ends,
+when it's full, before reading stdin (so that prompts show), at bye, at exit
+and on explicit request (cflush).
+*/
+
+static void con_flush(Forth *f)
+{
+    if (f->conlen > 0) {
+        fwrite(f->conbuf, 1, f->conlen, stdout);
+        f->conlen = 0;
+    }
+    fflush(stdout);
+}
+
+static void con_putc(Forth *f, char c)
+{
+    f->conbuf[f->conlen++] = c;
+    if ((c == '\n') || (f->conlen == CONBUF_SIZE)) {
+        con_flush(f);
+    }
+}
+
+static void con_printf(Forth *f, const char *fmt, ...)
+{
+    char buf[0x100];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len >= (int)sizeof(buf)) {
+        len = sizeof(buf) - 1;
+    }
+    for (int i=0; i<len; i++) {
+        con_putc(f, buf[i]);
+    }
 }
 
-static void error(char *msg)
+static void error(Forth *f, char *msg)
 {
     if (msg != NULL) {
         fprintf(stderr, "%s\n", msg);
     }
-    _interpret("abort");
+    _interpret(f, "abort");
     return;
 }
 
-static void push(uint16_t x)
+/* Data stack
+
+The data stack is the z80 stack, but its top toscount cells are kept in tos
+instead, above SP. Words and primitives running on the host push and pop
+there, touching z80 memory only when it overflows. Anything that looks at the
+z80 stack, z80 code, SP or memory in the cached range, has to call tosflush()
+first, which makes the z80 stack whole again.
+*/
+
+static void tosflush(Forth *f)
 {
-    m->cpu.R1.wr.SP -= 2;
-    writew(m->cpu.R1.wr.SP, x);
+    for (int i=0; i<f->toscount; i++) {
+        f->m->cpu.R1.wr.SP -= 2;
+        writew(f, f->m->cpu.R1.wr.SP, f->tos[i]);
+    }
+    f->toscount = 0;
 }
 
-static uint16_t pop()
+// Flushes if any of the len bytes at addr is in the cached range.
+static void tosreach(Forth *f, uint16_t addr, int len)
 {
-    if (m->cpu.R1.wr.SP == 0xffff) {
-        error("Stack underflow");
-        return 0;
+    uint16_t sp = f->m->cpu.R1.wr.SP;
+    if ((f->toscount > 0) && (addr+len > sp-2*f->toscount) && (addr < sp)) {
+        tosflush(f);
+    }
+}
+
+static void push(Forth *f, uint16_t x)
+{
+    if (f->toscount == f->toscap) {
+        if (f->toscap == 0) {
+            f->m->cpu.R1.wr.SP -= 2;
+            writew(f, f->m->cpu.R1.wr.SP, x);
+            return;
+        }
+        // Spill the oldest.
+        f->m->cpu.R1.wr.SP -= 2;
+        writew(f, f->m->cpu.R1.wr.SP, f->tos[0]);
+        for (int i=1; i<f->toscount; i++) {
+            f->tos[i-1] = f->tos[i];
+        }
+        f->toscount--;
+    }
+    f->tos[f->toscount++] = x;
+}
+
+// pop() without the underflow check, like z80's POP.
+static uint16_t rawpop(Forth *f)
+{
+    if (f->toscount > 0) {
+        return f->tos[--f->toscount];
     }
-    uint16_t r = readw(m->cpu.R1.wr.SP);
-    m->cpu.R1.wr.SP += 2;
+    uint16_t r = readw(f, f->m->cpu.R1.wr.SP);
+    f->m->cpu.R1.wr.SP += 2;
     return r;
 }
 
-static int readc()
+static uint16_t pop(Forth *f)
 {
-    return fgetc(curstream);
+    // The SP we'd have without the cache, as primitives popping from it with
+    // rawpop() can leave cells there with SP past the bottom.
+    if ((uint16_t)(f->m->cpu.R1.wr.SP - 2*f->toscount) == 0xffff) {
+        error(f, "Stack underflow");
+        return 0;
+    }
+    return rawpop(f);
 }
 
-static char* readword()
+// Runs z80 code at addr until it returns.
+static void runz80(Forth *f, uint16_t addr)
 {
-    int c;
-    char *s = &m->mem[CURWORD_ADDR];
-    *s = '\0';
-    while (1) {
-        c = readc();
-        if (c == EOF) {
-            return NULL;
+    tosflush(f);
+    emul_call(f->m, addr, RETSTUB_ADDR);
+}
+
+/* Profiler
+
+When profiling, execute(), run() and call() wrap what they run between
+profenter() and profexit(), which record for each entry its call count, host
+time and T-states spent. Times are inclusive (callees counted) and exclusive
+(callees not counted). When we're not profiling, all it costs is a check of
+the profiling flag.
+*/
+
+static uint64_t nanotime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void profenter(Forth *f, uint16_t offset)
+{
+    if (f->profdepth == PROF_DEPTH) {
+        f->profoverflow++;
+        return;
+    }
+    ProfFrame *fr = &f->profstack[f->profdepth++];
+    fr->offset = offset;
+    fr->children = 0;
+    fr->tstates = f->m->cpu.tstates;
+    f->profdata[offset].active++;
+    fr->start = nanotime();
+}
+
+static void profexit(Forth *f)
+{
+    uint64_t now = nanotime();
+    if (f->profoverflow > 0) {
+        f->profoverflow--;
+        return;
+    }
+    ProfFrame *fr = &f->profstack[--f->profdepth];
+    ProfData *d = &f->profdata[fr->offset];
+    uint64_t elapsed = now - fr->start;
+    if (d->count == 0) {
+        // The entry could be gone by the time we report.
+        strncpy(d->name, &f->m->mem[fr->offset+ENTRY_FIELD_NAME], NAME_LEN);
+    }
+    d->count++;
+    d->active--;
+    if (d->active == 0) {
+        d->incl += elapsed;
+    }
+    d->excl += elapsed - fr->children;
+    d->tstates += (unsigned int)(f->m->cpu.tstates - fr->tstates);
+    if (f->profdepth > 0) {
+        f->profstack[f->profdepth-1].children += elapsed;
+    }
+}
+
+// Returns the offset of the entry addr belongs to, 0 if it's not in the
+// dictionary.
+static uint16_t entryat(Forth *f, uint16_t addr)
+{
+    if (addr >= readw(f, HERE_ADDR)) {
+        return 0;
+    }
+    uint16_t offset = readw(f, CURRENT_ADDR);
+    while ((offset > 0) && (offset > addr)) {
+        offset = readw(f, offset+ENTRY_FIELD_PREV);
+    }
+    return (offset >= DICT_ADDR) ? offset : 0;
+}
+
+static void decodeitem(Forth *f, ThreadItem *ti, HeapItem *hi)
+{
+    if (hi->type == TYPE_NUM) {
+        ti->op = OP_NUM;
+        ti->arg = hi->arg;
+        ti->entry = 0;
+        return;
+    }
+    ti->entry = hi->arg;
+    DictionaryEntry de;
+    readentry(f, &de, hi->arg);
+    switch (de.type) {
+        case TYPE_COMPILED:
+            ti->op = OP_COMPILED;
+            ti->arg = de.offset;
+            break;
+        case TYPE_NATIVE:
+            if (de.arg < NATIVE_MAX) {
+                ti->op = OP_NATIVE;
+                ti->arg = de.arg;
+            } else if (findprim(f, de.offset) >= 0) {
+                ti->op = OP_PRIM;
+                ti->arg = findprim(f, de.offset);
+            } else {
+                ti->op = OP_Z80;
+                ti->arg = de.offset+ENTRY_FIELD_DATA;
+            }
+            break;
+        case TYPE_CELL:
+            ti->op = OP_CELL;
+            ti->arg = de.offset+ENTRY_FIELD_DATA;
+            break;
+        case TYPE_ZCOMPILED:
+            ti->op = OP_Z80;
+            ti->arg = de.offset+ENTRY_FIELD_DATA;
+            break;
+    }
+}
+
+// Replaces sequences of primitives having a superinstruction with OP_SUPER. The
+// items it covers stay as they are, so that items still match the heap one
+// for one.
+static void fuse(Forth *f, ThreadedCode *tc)
+{
+    for (int i=0; i<tc->count-1; i++) {
+        int best = -1;
+        for (int s=0; s<f->supercount; s++) {
+            int j = 0;
+            // OP_EXIT stops us before the end.
+            while ((j < f->supers[s].len) && (tc->items[i+j].op == OP_PRIM) &&
+                (tc->items[i+j].arg == f->supers[s].prims[j])) {
+                j++;
+            }
+            if ((j == f->supers[s].len) &&
+                ((best < 0) || (f->supers[s].len > f->supers[best].len))) {
+                best = s;
+            }
+        }
+        if (best >= 0) {
+            tc->items[i].op = OP_SUPER;
+            tc->items[i].arg = best;
+            tc->items[i].entry = f->supers[best].offset;
+            i += f->supers[best].len - 1;
+        }
+    }
+}
+
+// Makes all threaded code stale if the heap items it was decoded from were
+// written to since we last checked. Returns true if it did.
+static bool threadcheck(Forth *f)
+{
+    if (f->m->watchhits == f->watchhits) {
+        return false;
+    }
+    f->watchhits = f->m->watchhits;
+    f->dict_gen++;
+    return true;
+}
+
+static void freestale(Forth *f)
+{
+    while (f->stale != NULL) {
+        ThreadedCode *tc = f->stale;
+        f->stale = tc->stale;
+        free(tc);
+    }
+}
+
+// Returns the threaded code of the TYPE_COMPILED entry at offset, decoding it
+// if needed.
+static ThreadedCode* getthreaded(Forth *f, uint16_t offset)
+{
+    threadcheck(f);
+    ThreadedCode *tc = f->threaded[offset];
+    if ((tc != NULL) && (tc->gen == f->dict_gen)) {
+        return tc;
+    }
+    if (f->mapgen != f->dict_gen) {
+        memset(f->threadmap, 0, sizeof(f->threadmap));
+        f->mapgen = f->dict_gen;
+    }
+    int count = 1;
+    uint16_t end = offset+ENTRY_FIELD_DATA;
+    HeapItem hi = readheap(f, end);
+    while (hi.type != TYPE_STOP) {
+        count++;
+        end = hi.next;
+        hi = readheap(f, end);
+    }
+    // Writes to the items, STOP included, have to make this code stale.
+    for (uint16_t a=offset+ENTRY_FIELD_DATA; a<=end; a++) {
+        f->threadmap[a] = 1;
+    }
+    // We might be called while that code is running, so we decode in place
+    // whenever we can. When we can't, the running code keeps the old one
+    // until it looks again.
+    if ((tc == NULL) || (tc->count != count)) {
+        if ((tc != NULL) && (f->rundepth > 0)) {
+            tc->stale = f->stale;
+            f->stale = tc;
+        } else {
+            free(tc);
+        }
+        tc = malloc(sizeof(ThreadedCode) + count*sizeof(ThreadItem));
+        tc->count = count;
+        tc->stale = NULL;
+        f->threaded[offset] = tc;
+    }
+    tc->gen = f->dict_gen;
+    ThreadItem *ti = tc->items;
+    hi = readheap(f, offset+ENTRY_FIELD_DATA);
+    while (hi.type != TYPE_STOP) {
+        decodeitem(f, ti++, &hi);
+        hi = readheap(f, hi.next);
+    }
+    ti->op = OP_EXIT;
+    ti->entry = 0;
+    fuse(f, tc);
+    return tc;
+}
+
+/* Return stack
+
+Calls between compiled words don't recurse on the host: run() keeps where to
+return to on a return stack in z80 memory, 4 bytes per call:
+
+- 2b index of the item to return to, high bit set if the call is profiled
+- 2b offset of the entry that item belongs to
+
+A call followed by OP_EXIT doesn't push anything (it's a tail call), unless
+it's profiled.
+*/
+#define RFRAME_PROFILED 0x8000
+
+// Returns false if the return stack is full.
+static bool rpush(Forth *f, uint16_t offset, uint16_t index, bool profiled)
+{
+    if (f->rsp < RSTACK_ADDR-RSTACK_SIZE+4) {
+        error(f, "Return stack overflow");
+        return false;
+    }
+    f->rsp -= 4;
+    if (profiled) {
+        index |= RFRAME_PROFILED;
+    }
+    // Same as two writew(), with a single touch.
+    byte *p = &f->m->mem[f->rsp];
+    p[0] = index & 0xff;
+    p[1] = index >> 8;
+    p[2] = offset & 0xff;
+    p[3] = offset >> 8;
+    emul_touch(f->m, f->rsp, 4);
+    return true;
+}
+
+static uint16_t rpop(Forth *f, uint16_t *offset, bool *profiled)
+{
+    uint16_t index = readw(f, f->rsp);
+    *offset = readw(f, f->rsp+2);
+    f->rsp += 4;
+    *profiled = (index & RFRAME_PROFILED) != 0;
+    return index & ~RFRAME_PROFILED;
+}
+
+// Item at index of tc, its OP_EXIT if the code got shorter.
+static ThreadItem* threaditem(ThreadedCode *tc, int index)
+{
+    return &tc->items[(index < tc->count) ? index : tc->count-1];
+}
+
+static void runleave(Forth *f)
+{
+    f->rundepth--;
+    if (f->rundepth == 0) {
+        freestale(f);
+    }
+}
+
+// Inner interpreter. Runs the threaded code of entry at offset until it
+// returns or until we quit.
+static void run(Forth *f, uint16_t offset)
+{
+    f->rundepth++;
+    uint16_t base = f->rsp;
+    ThreadedCode *tc = getthreaded(f, offset);
+    ThreadItem *ti = tc->items;
+    while (!_quitting(f)) {
+        bool profiled = f->profiling && (ti->entry > 0);
+        if (profiled) {
+            profenter(f, ti->entry);
+        }
+        switch (ti->op) {
+            case OP_NUM:
+            case OP_CELL:
+                push(f, ti->arg);
+                break;
+            case OP_NATIVE:
+                call_native(f, ti->arg);
+                break;
+            case OP_Z80:
+                runz80(f, ti->arg);
+                break;
+            case OP_PRIM:
+                if (f->seqprofiling) {
+                    countseq(f, ti);
+                }
+                runprim(f, ti->arg);
+                break;
+            case OP_COMPILED:
+                if (profiled || (ti[1].op != OP_EXIT)) {
+                    if (!rpush(f, offset, ti+1 - tc->items, profiled)) {
+                        break;
+                    }
+                }
+                offset = ti->arg;
+                tc = getthreaded(f, offset);
+                ti = tc->items;
+                continue;
+            case OP_SUPER:
+                runsuper(f, ti->arg);
+                ti += f->supers[ti->arg].len - 1;
+                break;
+            case OP_EXIT:
+                if (f->rsp == base) {
+                    runleave(f);
+                    return;
+                }
+                // The code we return to might have been decoded again since.
+                uint16_t index = rpop(f, &offset, &profiled);
+                tc = getthreaded(f, offset);
+                ti = threaditem(tc, index);
+                if (profiled) {
+                    profexit(f);
+                }
+                continue;
+        }
+        if (profiled) {
+            profexit(f);
         }
-        if (c > ' ') break;
+        ti++;
+        // What we ran might have written to the code we run.
+        if (threadcheck(f) || (tc->gen != f->dict_gen)) {
+            int index = ti - tc->items;
+            tc = getthreaded(f, offset);
+            ti = threaditem(tc, index);
+        }
+    }
+    // Unwind what we called, as returning would.
+    while (f->rsp < base) {
+        bool profiled;
+        rpop(f, &offset, &profiled);
+        if (profiled) {
+            profexit(f);
+        }
+    }
+    runleave(f);
+}
+
+/* Machine swaps
+
+The return stack belongs to run(), not to the machine: words replacing the
+machine's memory while compiled words run keep its live frames as they were.
+rkeep() copies them out and rrestore() puts them back.
+*/
+
+static uint16_t rkeep(Forth *f, byte *buf)
+{
+    uint16_t len = RSTACK_ADDR - f->rsp;
+    memcpy(buf, &f->m->mem[f->rsp], len);
+    return len;
+}
+
+static void rrestore(Forth *f, byte *buf, uint16_t len)
+{
+    memcpy(&f->m->mem[f->rsp], buf, len);
+    emul_touch(f->m, f->rsp, len);
+}
+
+// Returns false when there's nothing left to read in src.
+static bool fillsrc(Forth *f, InputSource *src)
+{
+    if (src->pos < src->len) {
+        return true;
+    }
+    if (src->fp == NULL) {
+        return false;
+    }
+    con_flush(f);
+    ssize_t read = getline(&src->buf, &src->cap, src->fp);
+    if (read <= 0) {
+        return false;
     }
+    src->len = read;
+    src->pos = 0;
+    return true;
+}
+
+static int readc(Forth *f)
+{
+    if (!fillsrc(f, f->cursrc)) {
+        return EOF;
+    }
+    return (byte)f->cursrc->buf[f->cursrc->pos++];
+}
+
+// Copies the next word in CURWORD, and the whitespace that ended it in
+// LASTWS, where Forth code can see them. A word never spans two refills: a
+// stdin line always ends with whitespace, unless it's the last one, in which
+// case the word ends at EOF.
+static char* readword(Forth *f)
+{
+    InputSource *src = f->cursrc;
+    byte *s = &f->m->mem[CURWORD_ADDR];
     while (1) {
-        *s = c;
-        s++;
-        c = readc();
-        if ((c == EOF) || (c <= ' ')) break;
+        while ((src->pos < src->len) && ((byte)src->buf[src->pos] <= ' ')) {
+            src->pos++;
+        }
+        if (src->pos < src->len) break;
+        // A new line has to have its whitespace skipped too.
+        if (fillsrc(f, src)) continue;
+        *s = '\0';
+        emul_touch(f->m, CURWORD_ADDR, 1);
+        return NULL;
+    }
+    size_t start = src->pos;
+    while ((src->pos < src->len) && ((byte)src->buf[src->pos] > ' ')) {
+        src->pos++;
+    }
+    size_t len = src->pos - start;
+    int c = EOF;
+    if (src->pos < src->len) {
+        c = (byte)src->buf[src->pos++];
+    }
+    // Don't let a huge word spill over our system variables.
+    if (len > FORGOTTEN_ADDR - CURWORD_ADDR - 1) {
+        len = FORGOTTEN_ADDR - CURWORD_ADDR - 1;
     }
-    m->mem[LASTWS_ADDR] = c;
-    *s = '\0';
-    return &m->mem[CURWORD_ADDR];
+    memcpy(s, &src->buf[start], len);
+    s[len] = '\0';
+    writeb(f, LASTWS_ADDR, c);
+    emul_touch(f->m, CURWORD_ADDR, len + 1);
+    return (char *)s;
 }
 
-static void compile(HeapItem *hi, char *word)
+static void compile(Forth *f, HeapItem *hi, char *word)
 {
     hi->type = TYPE_STOP;
     if ((word == NULL) || (*word == '\0')) { // EOL
         return;
     }
-    DictionaryEntry de = find(word);
+    DictionaryEntry de = find(f, word);
     if (de.offset > 0) {
         hi->type = TYPE_WORD;
         hi->arg = de.offset;
@@ -290,468 +1176,2410 @@ static void compile(HeapItem *hi, char *word)
         } else {
             // not a number
             fprintf(stderr, "What is %s?\n", word);
-            error(NULL);
+            error(f, NULL);
         }
     }
 }
 
-static HeapItemType execstep(HeapItem *hi)
+static HeapItemType execstep(Forth *f, HeapItem *hi)
 {
-    if (_quitting()) return TYPE_STOP;
+    if (_quitting(f)) return TYPE_STOP;
     switch (hi->type) {
         case TYPE_NUM:
-            push(hi->arg);
+            push(f, hi->arg);
             break;
         case TYPE_WORD:
-            push(hi->arg);
-            execute();
+            push(f, hi->arg);
+            execute(f);
             break;
     }
     return hi->type;
 }
 
-// Not static because it's used in core_forth.c
-void interpret_line(char *line)
+static void interpret_line(Forth *f, char *line)
 {
-    FILE *oldstream = curstream;
-    curstream = fmemopen(line, strlen(line), "r");
-    _unquit();
-    while (interpret());
-    fclose(curstream);
-    curstream = oldstream;
+    InputSource src = {line, strlen(line), 0, NULL, 0};
+    InputSource *oldsrc = f->cursrc;
+    f->cursrc = &src;
+    _unquit(f);
+    while (interpret(f));
+    f->cursrc = oldsrc;
 }
 
 // Callable
-static void execute() {
-    int offset = pop();
-    if (_quitting()) return;
+static void execute(Forth *f) {
+    int offset = pop(f);
+    if (_quitting(f)) return;
+    bool profiled = f->profiling;
+    if (profiled) {
+        profenter(f, offset);
+    }
     DictionaryEntry de;
-    readentry(&de, offset);
+    readentry(f, &de, offset);
     switch (de.type) {
         case TYPE_COMPILED:
-            offset = offset + ENTRY_FIELD_DATA;
-            HeapItem hi = readheap(offset);
-            while (execstep(&hi) != TYPE_STOP) {
-                hi = readheap(hi.next);
-            }
+            run(f, offset);
             break;
         case TYPE_NATIVE:
-            if (de.arg < 0x20) {
-                call_native(de.arg);
+            if (de.arg < NATIVE_MAX) {
+                call_native(f, de.arg);
+            } else if (findprim(f, offset) >= 0) {
+                runprim(f, findprim(f, offset));
             } else {
-                push(offset+ENTRY_FIELD_DATA);
-                call();
+                runz80(f, offset+ENTRY_FIELD_DATA);
             }
             break;
         case TYPE_CELL:
-            push(offset+ENTRY_FIELD_DATA);
+            push(f, offset+ENTRY_FIELD_DATA);
             break;
+        case TYPE_ZCOMPILED:
+            runz80(f, offset+ENTRY_FIELD_DATA);
+            break;
+    }
+    if (profiled) {
+        profexit(f);
     }
 }
 
-static bool _interpret(char *word)
+static bool _interpret(Forth *f, char *word)
 {
     HeapItem hi;
-    compile(&hi, word);
-    return execstep(&hi) != TYPE_STOP;
+    compile(f, &hi, word);
+    return execstep(f, &hi) != TYPE_STOP;
 }
 
 // Returns true if we still have words to interpret.
-static bool interpret() {
-    if (_quitting()) return false;
-    char *word = readword();
+static bool interpret(Forth *f) {
+    if (_quitting(f)) return false;
+    char *word = readword(f);
     if (word == NULL) {
         return false;
     }
-    return _interpret(word);
+    return _interpret(f, word);
 }
 
-static void bye()
+static void bye(Forth *f)
 {
-    running = false;
+    f->running = false;
+    con_flush(f);
 }
 
-static void dot()
+static void dot(Forth *f)
+{
+    uint16_t num = pop(f);
+    if (_quitting(f)) return;
+    con_printf(f, "%d", num);
+}
+
+static void dotx(Forth *f)
+{
+    uint16_t num = pop(f);
+    if (_quitting(f)) return;
+    con_printf(f, "%02x", num);
+}
+
+/* Inlining
+
+Words are bound when a definition is compiled: redefining a word doesn't
+change the definitions already using it. Inlining a body is thus the same as
+calling it, as long as that body stays where it is. It's never overwritten
+while someone uses it: forget only gives back heap space when it removes the
+latest entry, which nobody else can use. Inlined copies actually hold better
+than calls, since they don't depend on the callee staying in memory at all.
+*/
+
+// Appends hi to items, or the body of the word it calls if it's small
+// enough. self is the entry being defined, which has no body yet. Returns the
+// new count.
+static int inlineitem(Forth *f, HeapItem *items, int count, HeapItem *hi, uint16_t self,
+    int depth)
 {
-    uint16_t num = pop();
-    if (_quitting()) return;
-    printf("%d", num);
+    if ((f->inline_max > 0) && (hi->type == TYPE_WORD) && (hi->arg != self) &&
+        (depth < INLINE_DEPTH)) {
+        DictionaryEntry de;
+        readentry(f, &de, hi->arg);
+        if (de.type == TYPE_COMPILED) {
+            int len = 0;
+            HeapItem bi = readheap(f, de.offset+ENTRY_FIELD_DATA);
+            while ((bi.type != TYPE_STOP) && (len <= f->inline_max)) {
+                len++;
+                bi = readheap(f, bi.next);
+            }
+            if (len <= f->inline_max) {
+                bi = readheap(f, de.offset+ENTRY_FIELD_DATA);
+                while (bi.type != TYPE_STOP) {
+                    count = inlineitem(f, items, count, &bi, self, depth+1);
+                    bi = readheap(f, bi.next);
+                }
+                return count;
+            }
+        }
+    }
+    if (count == DEFITEMS_MAX) {
+        error(f, "Definition too long");
+        return count;
+    }
+    items[count++] = *hi;
+    return count;
 }
 
-static void dotx()
+// Something went wrong while defining de, let's rollback on that new entry.
+static void undefine(Forth *f, DictionaryEntry *de)
 {
-    uint16_t num = pop();
-    if (_quitting()) return;
-    printf("%02x", num);
+    hashremove(f, de->offset);
+    f->dict_gen++;
+    writew(f, CURRENT_ADDR, de->prev);
+    writew(f, HERE_ADDR, de->offset);
 }
 
-static void define()
+static void define(Forth *f)
 {
-    char *word = readword();
+    char *word = readword(f);
     if (!*word) {
-        error("No define name");
+        error(f, "No define name");
         return;
     }
     // we start writing the heap right after the entry's header
-    DictionaryEntry de = _create(word, TYPE_COMPILED, 0);
-    word = readword();
+    DictionaryEntry de = _create(f, word, TYPE_COMPILED, 0);
+    if (_quitting(f)) {
+        return;
+    }
+    word = readword(f);
+    int count = 0;
     HeapItem hi;
     while ((*word) && (*word != ';')) {
-        compile(&hi, word);
-        writeheap(&hi);
-        if (_quitting()) {
-            // Something went wrong, let's rollback on new entry
-            writew(CURRENT_ADDR, de.prev);
-            writew(HERE_ADDR, de.offset);
+        compile(f, &hi, word);
+        if (!_quitting(f)) {
+            count = inlineitem(f, f->defitems, count, &hi, de.offset, 0);
+        }
+        if (_quitting(f)) {
+            undefine(f, &de);
             return;
         }
-        word = readword();
+        word = readword(f);
+    }
+    if (f->optimizing) {
+        count = optimize(f, f->defitems, count);
+    }
+    if (f->zcompiling && zdefine(f, &de, f->defitems, count)) {
+        return;
+    }
+    for (int i=0; (i<count) && !_quitting(f); i++) {
+        writeheap(f, &f->defitems[i]);
     }
     hi.type = TYPE_STOP;
-    writeheap(&hi);
+    if (!_quitting(f)) {
+        writeheap(f, &hi);
+    }
+    if (_quitting(f)) {
+        undefine(f, &de);
+        return;
+    }
+    getthreaded(f, de.offset);
 }
 
-static void loadf()
+static void loadf(Forth *f)
 {
-    char *line = NULL;
-    ssize_t read;
-    ssize_t len = 0;
-    char *fname = readword();
+    char *fname = readword(f);
 
     if (!fname) {
-        error("Missing filename");
+        error(f, "Missing filename");
         return;
     }
-    FILE *oldstream = curstream;
-    curstream = fopen(fname, "r");
-    if (!curstream) {
-        error("Can't open file");
-        curstream = oldstream;
+    struct stat st;
+    int fd = open(fname, O_RDONLY);
+    if ((fd < 0) || (fstat(fd, &st) != 0)) {
+        if (fd >= 0) close(fd);
+        error(f, "Can't open file");
         return;
     }
-    _unquit();
-    while (interpret());
-    fclose(curstream);
-    curstream = oldstream;
+    InputSource src = {NULL, 0, 0, NULL, 0};
+    if (S_ISREG(st.st_mode)) {
+        src.len = st.st_size;
+        if (src.len > 0) {
+            src.buf = mmap(NULL, src.len, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+    } else {
+        // Pipes and the like have no size: we read them a line at a time, like
+        // stdin.
+        src.fp = fdopen(fd, "r");
+        if (src.fp == NULL) {
+            close(fd);
+        }
+    }
+    if ((src.buf == MAP_FAILED) || (!S_ISREG(st.st_mode) && (src.fp == NULL))) {
+        error(f, "Can't open file");
+        return;
+    }
+    InputSource *oldsrc = f->cursrc;
+    f->cursrc = &src;
+    _unquit(f);
+    while (interpret(f));
+    f->cursrc = oldsrc;
+    if (src.fp != NULL) {
+        fclose(src.fp);
+        free(src.buf);
+    } else if (src.len > 0) {
+        munmap(src.buf, src.len);
+    }
+}
+
+// Brings our host-side caches in line with a dictionary that was replaced
+// wholesale.
+static void dictsync(Forth *f)
+{
+    reindex(f);
+    f->dict_gen++;
+    bindprims(f);
+    bindsupers(f);
+    bindcore(f);
 }
 
-static void forget()
+static void forget(Forth *f)
 {
-    char *word = readword();
+    char *word = readword(f);
     if (!*word) {
-        error("No specified name");
+        error(f, "No specified name");
         return;
     }
-    DictionaryEntry de = find(word);
+    DictionaryEntry de = find(f, word);
     if (de.offset == 0) {
-        error("Name not found");
+        error(f, "Name not found");
         return;
     }
-    if (de.offset == readw(CURRENT_ADDR)) {
+    hashremove(f, de.offset);
+    f->dict_gen++;
+    if (de.offset == readw(f, CURRENT_ADDR)) {
         // We're the last of the chain
-        writew(CURRENT_ADDR, de.prev);
-        writew(HERE_ADDR, de.offset);
+        writew(f, CURRENT_ADDR, de.prev);
+        writew(f, HERE_ADDR, de.offset);
+        prunegone(f);
     } else {
         // not the last, we have to hook stuff.
-        // de.next is the offset of the next entry. We need to write "de.prev"
-        // in that entry's "prev" offset, which is offset+9
-        writew(de.next+9, de.prev);
+        // We need to write "de.prev" in the "prev" field of the entry that
+        // follows us in the chain.
+        writew(f, findnext(f, de.offset)+ENTRY_FIELD_PREV, de.prev);
+        // Our space stays taken until compact.
+        writew(f, de.offset+ENTRY_FIELD_PREV, readw(f, FORGOTTEN_ADDR));
+        writew(f, FORGOTTEN_ADDR, de.offset);
+    }
+    bindsupers(f);
+}
+
+/* Compaction
+
+Forgetting an entry that isn't the last one leaves a hole in the dictionary.
+Entries being allocated one after the other at HERE, an entry extends up to
+the next entry in memory, forgotten or not, so forget keeps the forgotten
+ones in a chain starting at FORGOTTEN_ADDR to tell where holes are.
+
+compact slides entries down over the holes and relocates what refers to them:
+prev links, CURRENT and HERE, TYPE_WORD items of compiled words (whose z80 code
+is then written again for TYPE_ZCOMPILED ones) and the entries core words are
+bound to. Forgotten entries that compiled words still use are moved along and
+stay forgotten. Addresses held anywhere else, in variables, on the stack or in
+z80 code for instance, aren't relocated: we can't tell them from numbers.
+*/
+
+// Drops forgotten entries that are at or past HERE: they're gone for good.
+static void prunegone(Forth *f)
+{
+    uint16_t here = readw(f, HERE_ADDR);
+    uint16_t link = FORGOTTEN_ADDR;
+    uint16_t offset = readw(f, link);
+    while (offset > 0) {
+        uint16_t prev = readw(f, offset+ENTRY_FIELD_PREV);
+        if (offset >= here) {
+            writew(f, link, prev);
+        } else {
+            link = offset+ENTRY_FIELD_PREV;
+        }
+        offset = prev;
+    }
+}
+
+#define ENTRY_NONE 0
+#define ENTRY_LINKED 1
+#define ENTRY_FORGOTTEN 2
+
+static void compact(Forth *f)
+{
+    if (f->rundepth > 0) {
+        error(f, "Can't compact while running");
+        return;
+    }
+    uint16_t here = readw(f, HERE_ADDR);
+    byte *kind = calloc(0x10000, 1);
+    // Where entries we keep end up, 0 for those we drop.
+    uint16_t *moved = calloc(0x10000, sizeof(uint16_t));
+    uint16_t *starts = malloc(0x10000 * sizeof(uint16_t));
+    for (uint16_t o=readw(f, CURRENT_ADDR); o>0; o=readw(f, o+ENTRY_FIELD_PREV)) {
+        kind[o] = ENTRY_LINKED;
+        moved[o] = 1;
+    }
+    for (uint16_t o=readw(f, FORGOTTEN_ADDR); o>0; o=readw(f, o+ENTRY_FIELD_PREV)) {
+        kind[o] = ENTRY_FORGOTTEN;
+    }
+    // Core words keep what they use.
+    for (int i=0; i<COREREFS_MAX; i++) {
+        if (kind[f->corerefs[i]] != ENTRY_NONE) {
+            moved[f->corerefs[i]] = 1;
+        }
+    }
+    int count = 0;
+    for (int o=DICT_ADDR; o<here; o++) {
+        if (kind[o] != ENTRY_NONE) {
+            starts[count++] = o;
+        }
     }
+    // Keep the forgotten entries compiled words use, until there's no new
+    // one. Entries only refer to older ones.
+    for (int i=count-1; i>=0; i--) {
+        uint16_t o = starts[i];
+        if (!moved[o]) {
+            continue;
+        }
+        uint16_t heap = o+ENTRY_FIELD_DATA;
+        if (f->m->mem[o+ENTRY_FIELD_TYPE] != TYPE_COMPILED) {
+            heap = zheap(f, o);
+        }
+        if (heap == 0) {
+            continue;
+        }
+        HeapItem hi = readheap(f, heap);
+        while (hi.type != TYPE_STOP) {
+            if ((hi.type == TYPE_WORD) && (kind[hi.arg] != ENTRY_NONE)) {
+                moved[hi.arg] = 1;
+            }
+            hi = readheap(f, hi.next);
+        }
+    }
+    // Slide entries down.
+    uint16_t dest = (count > 0) ? starts[0] : here;
+    uint16_t lowest = dest;
+    for (int i=0; i<count; i++) {
+        uint16_t o = starts[i];
+        uint16_t len = ((i+1 < count) ? starts[i+1] : here) - o;
+        if (!moved[o]) {
+            continue;
+        }
+        memmove(&f->m->mem[dest], &f->m->mem[o], len);
+        moved[o] = dest;
+        dest += len;
+    }
+    emul_touch(f->m, lowest, here-lowest);
+    // Relocate references.
+    uint16_t forgotten = 0;
+    for (int i=0; i<count; i++) {
+        uint16_t o = starts[i];
+        uint16_t n = moved[o];
+        if (n == 0) {
+            continue;
+        }
+        if (kind[o] == ENTRY_LINKED) {
+            writew(f, n+ENTRY_FIELD_PREV, moved[readw(f, n+ENTRY_FIELD_PREV)]);
+        } else {
+            writew(f, n+ENTRY_FIELD_PREV, forgotten);
+            forgotten = n;
+        }
+        byte type = f->m->mem[n+ENTRY_FIELD_TYPE];
+        // A definition compiled to z80 code keeps its items after the code,
+        // which we write again from them. Its slot moved along with it.
+        uint16_t zslot = 0;
+        if (zheap(f, n) > 0) {
+            zslot = zheap(f, n)-2 - o + n;
+        }
+        if ((type == TYPE_COMPILED) || (zslot > 0)) {
+            int offset = (zslot > 0) ? zslot+2 : n+ENTRY_FIELD_DATA;
+            HeapItem hi = readheap(f, offset);
+            while (hi.type != TYPE_STOP) {
+                if ((hi.type == TYPE_WORD) && moved[hi.arg]) {
+                    writew(f, offset+1, moved[hi.arg]);
+                }
+                offset = hi.next;
+                hi = readheap(f, offset);
+            }
+            if (zslot > 0) {
+                zwrite(f, n+ENTRY_FIELD_DATA, zslot);
+            }
+        }
+    }
+    for (int i=0; i<COREREFS_MAX; i++) {
+        f->corerefs[i] = moved[f->corerefs[i]];
+    }
+    writew(f, CURRENT_ADDR, moved[readw(f, CURRENT_ADDR)]);
+    writew(f, FORGOTTEN_ADDR, forgotten);
+    writew(f, HERE_ADDR, dest);
+    free(kind);
+    free(moved);
+    free(starts);
+    dictsync(f);
 }
 
-static void create()
+static void create(Forth *f)
 {
-    char *word = readword();
+    char *word = readword(f);
     if (!*word) {
-        error("Name needed");
+        error(f, "Name needed");
         return;
     }
     // The create word doesn't allot any data.
-    _create(word, TYPE_CELL, 0);
+    _create(f, word, TYPE_CELL, 0);
 }
 
 // get pointer to word reg
-static ushort* _getwreg(char *name)
+static ushort* _getwreg(Forth *f, char *name)
 {
     if (strcmp(name, "AF") == 0) {
-        return &m->cpu.R1.wr.AF;
+        return &f->m->cpu.R1.wr.AF;
     } else if (strcmp(name, "BC") == 0) {
-        return &m->cpu.R1.wr.BC;
+        return &f->m->cpu.R1.wr.BC;
     } else if (strcmp(name, "DE") == 0) {
-        return &m->cpu.R1.wr.DE;
+        return &f->m->cpu.R1.wr.DE;
     } else if (strcmp(name, "HL") == 0) {
-        return &m->cpu.R1.wr.HL;
+        return &f->m->cpu.R1.wr.HL;
     } else if (strcmp(name, "IX") == 0) {
-        return &m->cpu.R1.wr.IX;
+        return &f->m->cpu.R1.wr.IX;
     } else if (strcmp(name, "IY") == 0) {
-        return &m->cpu.R1.wr.IY;
+        return &f->m->cpu.R1.wr.IY;
     } else if (strcmp(name, "SP") == 0) {
-        return &m->cpu.R1.wr.SP;
+        return &f->m->cpu.R1.wr.SP;
     }
     return NULL;
 }
 
-static byte* _getbreg(char *name)
+static byte* _getbreg(Forth *f, char *name)
 {
     if (name[1] != '\0') {
         return NULL;
     }
     switch (name[0]) {
-        case 'A': return &m->cpu.R1.br.A;
-        case 'F': return &m->cpu.R1.br.F;
-        case 'B': return &m->cpu.R1.br.B;
-        case 'C': return &m->cpu.R1.br.C;
-        case 'D': return &m->cpu.R1.br.D;
-        case 'E': return &m->cpu.R1.br.E;
-        case 'H': return &m->cpu.R1.br.H;
-        case 'L': return &m->cpu.R1.br.L;
+        case 'A': return &f->m->cpu.R1.br.A;
+        case 'F': return &f->m->cpu.R1.br.F;
+        case 'B': return &f->m->cpu.R1.br.B;
+        case 'C': return &f->m->cpu.R1.br.C;
+        case 'D': return &f->m->cpu.R1.br.D;
+        case 'E': return &f->m->cpu.R1.br.E;
+        case 'H': return &f->m->cpu.R1.br.H;
+        case 'L': return &f->m->cpu.R1.br.L;
         default: return NULL;
     }
 }
 
-static void regr()
+static void regr(Forth *f)
 {
-    char *name = readword();
-    ushort *w = _getwreg(name);
+    tosflush(f);
+    char *name = readword(f);
+    ushort *w = _getwreg(f, name);
     if (w != NULL) {
-        push(*w);
+        push(f, *w);
     } else {
-        byte *b = _getbreg(name);
+        byte *b = _getbreg(f, name);
         if (b != NULL) {
-            push(*b);
+            push(f, *b);
         } else {
-            error("Invalid register\n");
+            error(f, "Invalid register\n");
         }
     }
 }
 
-static void regw()
+static void regw(Forth *f)
 {
-    char *name = readword();
-    ushort *w = _getwreg(name);
+    tosflush(f);
+    char *name = readword(f);
+    ushort *w = _getwreg(f, name);
     if (w != NULL) {
-        *w = pop();
+        *w = pop(f);
     } else {
-        byte *b = _getbreg(name);
+        byte *b = _getbreg(f, name);
         if (b != NULL) {
-            *b = pop();
+            *b = pop(f);
         } else {
-            error("Invalid register\n");
+            error(f, "Invalid register\n");
         }
     }
 }
 
-static void minus()
+static void minus(Forth *f)
 {
-    uint16_t n2 = pop();
-    uint16_t n1 = pop();
-    push(n1 - n2);
+    uint16_t n2 = pop(f);
+    uint16_t n1 = pop(f);
+    push(f, n1 - n2);
 }
 
-static void mult()
+static void mult(Forth *f)
 {
-    uint16_t n2 = pop();
-    uint16_t n1 = pop();
-    push(n1 * n2);
+    uint16_t n2 = pop(f);
+    uint16_t n1 = pop(f);
+    push(f, n1 * n2);
 }
 
-static void div_()
+static void div_(Forth *f)
 {
-    uint16_t n2 = pop();
-    uint16_t n1 = pop();
-    push(n1 / n2);
+    uint16_t n2 = pop(f);
+    uint16_t n1 = pop(f);
+    push(f, n1 / n2);
 }
 
-static void and_()
+static void and_(Forth *f)
 {
-    uint16_t n2 = pop();
-    uint16_t n1 = pop();
-    push(n1 & n2);
+    uint16_t n2 = pop(f);
+    uint16_t n1 = pop(f);
+    push(f, n1 & n2);
 }
 
-static void or_()
+static void or_(Forth *f)
 {
-    uint16_t n2 = pop();
-    uint16_t n1 = pop();
-    push(n1 | n2);
+    uint16_t n2 = pop(f);
+    uint16_t n1 = pop(f);
+    push(f, n1 | n2);
 }
 
-static void lshift()
+static void lshift(Forth *f)
 {
-    uint16_t x = pop();
-    uint16_t n = pop();
-    push(n << x);
+    uint16_t x = pop(f);
+    uint16_t n = pop(f);
+    push(f, n << x);
 }
 
-static void rshift()
+static void rshift(Forth *f)
 {
-    uint16_t x = pop();
-    uint16_t n = pop();
-    push(n >> x);
+    uint16_t x = pop(f);
+    uint16_t n = pop(f);
+    push(f, n >> x);
 }
 
-static void call()
+static void call(Forth *f)
 {
-    m->cpu.PC = pop();
-    int levels = 1;
-    // Run until we encounter a RET (0xc9) *and* that SP is at the same level
-    // as when we started.
-    m->cpu.halted = 0;
-    while (1) {
-        if (m->mem[m->cpu.PC] == 0xcd) { // CALL
-            levels++;
-        }
-        if (m->mem[m->cpu.PC] == 0xc9) { // RET
-            levels--;
-        }
-        if ((levels == 0) || !emul_step()) break;
+    uint16_t addr = pop(f);
+    uint16_t offset = f->profiling ? entryat(f, addr) : 0;
+    if (offset > 0) {
+        profenter(f, offset);
+    }
+    runz80(f, addr);
+    if (offset > 0) {
+        profexit(f);
     }
 }
 
-static void apos()
+static void apos(Forth *f)
 {
-    char *word = readword();
-    DictionaryEntry de = find(word);
+    char *word = readword(f);
+    DictionaryEntry de = find(f, word);
     if (de.offset == 0) {
-        error("Name not found");
+        error(f, "Name not found");
         return;
     }
-    push(de.offset);
+    push(f, de.offset);
 }
 
-static void see()
+static void see(Forth *f)
 {
-    uint16_t addr = pop();
+    uint16_t addr = pop(f);
     char buf[NAME_LEN+1] = {0};
-    strncpy(buf, &m->mem[addr+ENTRY_FIELD_NAME], NAME_LEN);
-    printf("Addr: %04x Type: %x Name: %s Prev: %04x Dump:\n",
-        addr, m->mem[addr], buf, readw(addr+ENTRY_FIELD_PREV));
+    strncpy(buf, &f->m->mem[addr+ENTRY_FIELD_NAME], NAME_LEN);
+    con_printf(f, "Addr: %04x Type: %x Name: %s Prev: %04x Dump:\n",
+        addr, f->m->mem[addr], buf, readw(f, addr+ENTRY_FIELD_PREV));
     for (int i=0; i<32; i++) {
-        printf("%02x", m->mem[addr+ENTRY_FIELD_DATA+i]);
+        con_printf(f, "%02x", f->m->mem[addr+ENTRY_FIELD_DATA+i]);
     }
-    printf("\n");
+    con_printf(f, "\n");
 }
 
-// Z80 I/Os
-static uint8_t iord_stdio()
+static void saveimage(Forth *f)
 {
-    int c = getchar();
-    if (c != EOF) {
-        return c & 0xff;
+    tosflush(f);
+    char *fname = readword(f);
+    if (!fname) {
+        error(f, "Missing filename");
+        return;
+    }
+    if (!emul_save(f->m, fname)) {
+        error(f, "Can't save image");
+    }
+}
+
+static void loadimage(Forth *f)
+{
+    tosflush(f);
+    char *fname = readword(f);
+    if (!fname) {
+        error(f, "Missing filename");
+        return;
+    }
+    byte frames[RSTACK_SIZE];
+    uint16_t len = rkeep(f, frames);
+    if (!emul_load(f->m, fname)) {
+        error(f, "Can't load image");
+        return;
+    }
+    rrestore(f, frames, len);
+    dictsync(f);
+}
+
+static void checkpoint(Forth *f)
+{
+    emul_checkpoint(f->m);
+}
+
+// Each diff we save starts a new checkpoint, so that a series of diffs gives
+// the whole history of a session.
+static void savediff(Forth *f)
+{
+    tosflush(f);
+    char *fname = readword(f);
+    if (!fname) {
+        error(f, "Missing filename");
+        return;
+    }
+    if (!emul_savediff(f->m, fname)) {
+        error(f, "Can't save diff");
+        return;
+    }
+    emul_checkpoint(f->m);
+}
+
+static void loaddiff(Forth *f)
+{
+    tosflush(f);
+    char *fname = readword(f);
+    if (!fname) {
+        error(f, "Missing filename");
+        return;
+    }
+    byte frames[RSTACK_SIZE];
+    uint16_t len = rkeep(f, frames);
+    if (!emul_loaddiff(f->m, fname)) {
+        error(f, "Can't load diff");
+        return;
+    }
+    rrestore(f, frames, len);
+    dictsync(f);
+}
+
+// Block buffers are host state that doesn't follow forks: we write them back
+// when forking and forget those of a discarded fork. Writes to the block file
+// itself stay.
+static void fork_(Forth *f)
+{
+    tosflush(f);
+    if (f->parent != NULL) {
+        error(f, "Already forked");
+        return;
+    }
+    Machine *child = emul_fork(f->m);
+    if (child == NULL) {
+        error(f, "Can't fork");
+        return;
+    }
+    blkflush(f);
+    f->parent = f->m;
+    f->m = child;
+}
+
+static void commit(Forth *f)
+{
+    tosflush(f);
+    if (f->parent == NULL) {
+        error(f, "Not forked");
+        return;
+    }
+    f->m = emul_commit(f->m);
+    f->parent = NULL;
+}
+
+static void discard(Forth *f)
+{
+    tosflush(f);
+    if (f->parent == NULL) {
+        error(f, "Not forked");
+        return;
+    }
+    byte frames[RSTACK_SIZE];
+    uint16_t len = rkeep(f, frames);
+    f->m = emul_discard(f->m);
+    f->parent = NULL;
+    rrestore(f, frames, len);
+    blkdrop(f);
+    dictsync(f);
+}
+
+static void banks(Forth *f)
+{
+    tosflush(f);
+    uint16_t count = pop(f);
+    if (_quitting(f)) return;
+    if (!emul_banks(f->m, BANK_ADDR, BANK_SIZE, count)) {
+        error(f, "Can't set banks");
+    }
+}
+
+static void bank(Forth *f)
+{
+    tosflush(f);
+    uint16_t index = pop(f);
+    if (_quitting(f)) return;
+    if (!emul_bank(f->m, index)) {
+        error(f, "Can't select bank");
+    }
+}
+
+static void primmode_(Forth *f)
+{
+    uint16_t mode = pop(f);
+    if (_quitting(f)) return;
+    if (mode > PRIM_CHECK) {
+        error(f, "Invalid primitive mode");
+        return;
+    }
+    // Checking compares z80 memory, where the stack has to be.
+    tosflush(f);
+    f->primmode = mode;
+    f->toscap = (mode == PRIM_NATIVE) ? TOS_CACHE : 0;
+}
+
+static void optimize_(Forth *f)
+{
+    uint16_t enabled = pop(f);
+    if (_quitting(f)) return;
+    f->optimizing = enabled != 0;
+}
+
+static void zcompile(Forth *f)
+{
+    uint16_t enabled = pop(f);
+    if (_quitting(f)) return;
+    f->zcompiling = enabled != 0;
+}
+
+static void inline_(Forth *f)
+{
+    uint16_t max = pop(f);
+    if (_quitting(f)) return;
+    f->inline_max = max;
+}
+
+static void profon(Forth *f)
+{
+    if (f->profdata == NULL) {
+        f->profdata = calloc(0x10000, sizeof(ProfData));
+    }
+    f->profiling = true;
+}
+
+static void profoff(Forth *f)
+{
+    f->profiling = false;
+}
+
+static void profrst(Forth *f)
+{
+    if (f->profdata == NULL) return;
+    for (int i=0; i<0x10000; i++) {
+        // Frames on the stack still need their active count.
+        unsigned int active = f->profdata[i].active;
+        memset(&f->profdata[i], 0, sizeof(ProfData));
+        f->profdata[i].active = active;
+    }
+}
+
+typedef struct {
+    uint16_t offset;
+    uint64_t excl;
+} ProfRank;
+
+static int profcmp(const void *a, const void *b)
+{
+    uint64_t ea = ((ProfRank *)a)->excl;
+    uint64_t eb = ((ProfRank *)b)->excl;
+    return (ea < eb) - (ea > eb);
+}
+
+// Fills offsets with the offsets of profiled entries, most costly first, and
+// returns their count.
+static int profsorted(Forth *f, uint16_t *offsets)
+{
+    int count = 0;
+    if (f->profdata == NULL) return 0;
+    ProfRank *ranks = malloc(0x10000 * sizeof(ProfRank));
+    for (int i=0; i<0x10000; i++) {
+        if (f->profdata[i].count > 0) {
+            ranks[count].offset = i;
+            ranks[count].excl = f->profdata[i].excl;
+            count++;
+        }
+    }
+    qsort(ranks, count, sizeof(ProfRank), profcmp);
+    for (int i=0; i<count; i++) {
+        offsets[i] = ranks[i].offset;
+    }
+    free(ranks);
+    return count;
+}
+
+static void profile(Forth *f)
+{
+    uint16_t offsets[0x10000];
+    int count = profsorted(f, offsets);
+    con_printf(f, "%-8s %4s %10s %12s %12s %12s\n",
+        "name", "addr", "count", "incl us", "excl us", "T-states");
+    for (int i=0; i<count; i++) {
+        ProfData *d = &f->profdata[offsets[i]];
+        con_printf(f, "%-8s %04x %10llu %12.1f %12.1f %12llu\n",
+            d->name, offsets[i], (unsigned long long)d->count,
+            d->incl / 1000.0, d->excl / 1000.0,
+            (unsigned long long)d->tstates);
+    }
+}
+
+static void profcsv(Forth *f)
+{
+    uint16_t offsets[0x10000];
+    int count = profsorted(f, offsets);
+    con_printf(f, "name,addr,count,incl_ns,excl_ns,tstates\n");
+    for (int i=0; i<count; i++) {
+        ProfData *d = &f->profdata[offsets[i]];
+        con_printf(f, "%s,0x%04x,%llu,%llu,%llu,%llu\n",
+            d->name, offsets[i], (unsigned long long)d->count,
+            (unsigned long long)d->incl, (unsigned long long)d->excl,
+            (unsigned long long)d->tstates);
+    }
+}
+
+static void zstats(Forth *f)
+{
+    uint16_t enabled = pop(f);
+    if (_quitting(f)) return;
+    emul_stats(f->m, enabled != 0);
+}
+
+// Writes, in buf, the name of the entry addr belongs to and the offset of
+// addr in it.
+static void addrname(Forth *f, char *buf, uint16_t addr)
+{
+    uint16_t offset = entryat(f, addr);
+    if (offset > 0) {
+        char name[NAME_LEN+1] = {0};
+        strncpy(name, &f->m->mem[offset+ENTRY_FIELD_NAME], NAME_LEN);
+        sprintf(buf, "%s %d", name, addr-offset);
+    } else if ((addr >= ROUTINES_ADDR) &&
+        (addr < ROUTINES_ADDR+sizeof(routines_bin))) {
+        sprintf(buf, "(routines) %d", addr-ROUTINES_ADDR);
     } else {
-        // EOF
-        return 0;
+        strcpy(buf, "- 0");
     }
 }
 
-static void iowr_stdio(uint8_t val)
+static void zdumphist(FILE *fp, char *prefix, uint64_t *hist)
 {
-    putchar(val);
+    for (int i=0; i<0x100; i++) {
+        if (hist[i] > 0) {
+            fprintf(fp, "op %s%02x %llu\n", prefix, i, (unsigned long long)hist[i]);
+        }
+    }
 }
 
-// Main loop
-static Callable native_funcs[] = {
-    bye, dot, execute, define, loadf,
-    forget, create, regr, regw, minus, mult, div_,
-    and_, or_, lshift, rshift, call, dotx, apos, see};
+// Writes emulator counters to a text file, one counter per line:
+// "pc addr count entry offset", "op opcode count" and
+// "page page reads writes".
+static void zdump(Forth *f)
+{
+    char *fname = readword(f);
+    if (!fname) {
+        error(f, "Missing filename");
+        return;
+    }
+    FILE *fp = fopen(fname, "w");
+    if (fp == NULL) {
+        error(f, "Can't open file");
+        return;
+    }
+    EmulStats *st = emul_getstats(f->m);
+    char where[NAME_LEN+0x20];
+    fprintf(fp, "instructions %llu\n", (unsigned long long)st->instructions);
+    fprintf(fp, "tstates %llu\n", (unsigned long long)st->tstates);
+    for (int i=0; i<0x10000; i++) {
+        if (st->pc[i] > 0) {
+            addrname(f, where, i);
+            fprintf(fp, "pc %04x %llu %s\n", i, (unsigned long long)st->pc[i], where);
+        }
+    }
+    zdumphist(fp, "", st->op);
+    zdumphist(fp, "cb", st->cbop);
+    zdumphist(fp, "ed", st->edop);
+    zdumphist(fp, "dd", st->ddop);
+    zdumphist(fp, "fd", st->fdop);
+    for (int i=0; i<0x100; i++) {
+        if ((st->reads[i] > 0) || (st->writes[i] > 0)) {
+            fprintf(fp, "page %02x %llu %llu\n", i,
+                (unsigned long long)st->reads[i], (unsigned long long)st->writes[i]);
+        }
+    }
+    fclose(fp);
+}
+
+/* Block device
+
+A host file, mmap'd, seen as a series of BLK_SIZE bytes blocks. z80 code
+reaches it through BLK_PORT: OUT (BLK_PORT),A with A=0 copies block BC to the
+memory at HL and with A=1, copies the memory at HL to block BC. IN A,
+(BLK_PORT) then gives 0 if that worked, 1 otherwise.
 
-static void call_native(int index)
+The block words keep BLK_BUFCOUNT buffers at BLKBUF_ADDR, reusing the least
+recently used one when they need a new one. A buffer is only written back
+when it was marked dirty by update, and only when it's reused or on flush.
+*/
+
+static bool blkread(Forth *f, uint16_t blk, uint16_t addr)
 {
-    native_funcs[index]();
+    if ((blk >= f->blkcount) || (addr > 0x10000-BLK_SIZE)) {
+        return false;
+    }
+    memcpy(&f->m->mem[addr], &f->blkmap[blk*BLK_SIZE], BLK_SIZE);
+    emul_touch(f->m, addr, BLK_SIZE);
+    return true;
 }
 
-static void nativeentry(char *name, int index)
+static bool blkwrite(Forth *f, uint16_t blk, uint16_t addr)
 {
-    DictionaryEntry de = _create(name, TYPE_NATIVE, 2);
-    writew(de.offset+ENTRY_FIELD_DATA, index);
+    if ((blk >= f->blkcount) || (addr > 0x10000-BLK_SIZE)) {
+        return false;
+    }
+    memcpy(&f->blkmap[blk*BLK_SIZE], &f->m->mem[addr], BLK_SIZE);
+    return true;
 }
 
-static void z80entry(char *name, unsigned char* bin, uint16_t binlen)
+static uint8_t iord_blk(Machine *m)
 {
-    DictionaryEntry de = _create(name, TYPE_NATIVE, binlen+1);
-    for (int i=0; i<binlen; i++) {
-        m->mem[de.offset+ENTRY_FIELD_DATA+i] = bin[i];
+    Forth *f = m->hostctx;
+    return f->blkstatus;
+}
+
+static void iowr_blk(Machine *m, uint8_t val)
+{
+    Forth *f = m->hostctx;
+    bool ok = false;
+    if (val == 0) {
+        ok = blkread(f, m->cpu.R1.wr.BC, m->cpu.R1.wr.HL);
+    } else if (val == 1) {
+        ok = blkwrite(f, m->cpu.R1.wr.BC, m->cpu.R1.wr.HL);
     }
-    // End with a RET (0xc9)
-    m->mem[de.offset+ENTRY_FIELD_DATA+binlen] = 0xc9;
+    f->blkstatus = ok ? 0 : 1;
 }
 
-static void init_dict()
+// Unassigns all buffers, without writing them.
+static void blkdrop(Forth *f)
 {
-    int i = 0;
-    // same order as in native_funcs
-    nativeentry("bye", i++);
-    nativeentry(".", i++);
-    nativeentry("execute", i++);
-    nativeentry(":", i++);
-    nativeentry("loadf", i++);
-    nativeentry("forget", i++);
-    nativeentry("create", i++);
-    nativeentry("regr", i++);
-    nativeentry("regw", i++);
-    nativeentry("-", i++);
-    nativeentry("*", i++);
-    nativeentry("/", i++);
-    nativeentry("and", i++);
-    nativeentry("or", i++);
-    nativeentry("lshift", i++);
-    nativeentry("rshift", i++);
-    nativeentry("call", i++);
-    nativeentry(".x", i++);
-    nativeentry("'", i++);
-    nativeentry("see", i++);
-    z80entry("+", plus_bin, sizeof(plus_bin));
-    z80entry("swap", swap_bin, sizeof(swap_bin));
-    z80entry("emit", emit_bin, sizeof(emit_bin));
-    z80entry("dup", dup_bin, sizeof(dup_bin));
-    z80entry("here", here_bin, sizeof(here_bin));
-    z80entry("current", current_bin, sizeof(current_bin));
-    z80entry("C!", storec_bin, sizeof(storec_bin));
-    z80entry("C@", fetchc_bin, sizeof(fetchc_bin));
-    z80entry("!", store_bin, sizeof(store_bin));
-    z80entry("@", fetch_bin, sizeof(fetch_bin));
-    z80entry("over", over_bin, sizeof(over_bin));
-    z80entry("rot", rot_bin, sizeof(rot_bin));
-    z80entry("drop", drop_bin, sizeof(drop_bin));
-    z80entry("quit", quit_bin, sizeof(quit_bin));
-    z80entry("abort", abort_bin, sizeof(abort_bin));
+    for (int i=0; i<BLK_BUFCOUNT; i++) {
+        f->blkbufs[i].blk = -1;
+        f->blkbufs[i].dirty = false;
+        f->blkbufs[i].used = 0;
+    }
+    f->blklast = -1;
 }
 
-int main(int argc, char *argv[])
+static uint8_t iord_bank(Machine *m)
+{
+    return emul_curbank(m);
+}
+
+static void iowr_bank(Machine *m, uint8_t val)
+{
+    if (!emul_bank(m, val)) {
+        fprintf(stderr, "Can't select bank %d\n", val);
+    }
+}
+
+// Writes dirty buffers back and unassigns all buffers.
+static void blkflush(Forth *f)
+{
+    for (int i=0; i<BLK_BUFCOUNT; i++) {
+        if ((f->blkbufs[i].blk >= 0) && f->blkbufs[i].dirty) {
+            blkwrite(f, f->blkbufs[i].blk, BLKBUF_ADDR+i*BLK_SIZE);
+        }
+    }
+    blkdrop(f);
+    if (f->blkmap != NULL) {
+        msync(f->blkmap, f->blkcount*BLK_SIZE, MS_SYNC);
+    }
+}
+
+static void blkfile(Forth *f)
+{
+    char *fname = readword(f);
+    if (!fname) {
+        error(f, "Missing filename");
+        return;
+    }
+    int fd = open(fname, O_RDWR);
+    struct stat st;
+    if ((fd < 0) || (fstat(fd, &st) != 0)) {
+        if (fd >= 0) close(fd);
+        error(f, "Can't open file");
+        return;
+    }
+    unsigned int count = st.st_size / BLK_SIZE;
+    if (count > 0x10000) {
+        count = 0x10000;
+    }
+    byte *map = MAP_FAILED;
+    if (count > 0) {
+        map = mmap(NULL, count*BLK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        error(f, "Can't map block file");
+        return;
+    }
+    if (f->blkmap != NULL) {
+        blkflush(f);
+        munmap(f->blkmap, f->blkcount*BLK_SIZE);
+    }
+    f->blkmap = map;
+    f->blkcount = count;
+    blkflush(f);
+}
+
+// Pushes the address of a buffer assigned to the block on TOS, reading the
+// block in it if read is set.
+static void blkget(Forth *f, bool read)
 {
-    curstream = stdin;
-    m = emul_init();
-    m->iord[STDIO_PORT] = iord_stdio;
-    m->iowr[STDIO_PORT] = iowr_stdio;
-    m->cpu.R1.wr.SP = 0xffff;
-    writew(HERE_ADDR, DICT_ADDR);
-    writew(CURRENT_ADDR, 0);
-    // Copy system routines in memory
-    for (int i=0; i<sizeof(routines_bin); i++) {
-        m->mem[ROUTINES_ADDR+i] = routines_bin[i];
-    }
-    init_dict();
-    running = true;
-    init_core_defs();
-    if (argc > 1) {
+    uint16_t blk = pop(f);
+    if (_quitting(f)) return;
+    if (f->blkmap == NULL) {
+        error(f, "No block file");
+        return;
+    }
+    if (blk >= f->blkcount) {
+        error(f, "Invalid block");
+        return;
+    }
+    int idx = -1;
+    for (int i=0; i<BLK_BUFCOUNT; i++) {
+        if (f->blkbufs[i].blk == blk) {
+            idx = i;
+        }
+    }
+    if (idx < 0) {
+        idx = 0;
+        for (int i=1; i<BLK_BUFCOUNT; i++) {
+            if (f->blkbufs[i].used < f->blkbufs[idx].used) {
+                idx = i;
+            }
+        }
+        BlockBuffer *b = &f->blkbufs[idx];
+        if ((b->blk >= 0) && b->dirty) {
+            blkwrite(f, b->blk, BLKBUF_ADDR+idx*BLK_SIZE);
+        }
+        b->blk = blk;
+        b->dirty = false;
+        if (read) {
+            blkread(f, blk, BLKBUF_ADDR+idx*BLK_SIZE);
+        }
+    }
+    f->blkbufs[idx].used = ++f->blkclock;
+    f->blklast = idx;
+    push(f, BLKBUF_ADDR+idx*BLK_SIZE);
+}
+
+static void block(Forth *f)
+{
+    blkget(f, true);
+}
+
+static void buffer(Forth *f)
+{
+    blkget(f, false);
+}
+
+static void update(Forth *f)
+{
+    if (f->blklast >= 0) {
+        f->blkbufs[f->blklast].dirty = true;
+    }
+}
+
+static void flush(Forth *f)
+{
+    blkflush(f);
+}
+
+static void cflush(Forth *f)
+{
+    con_flush(f);
+}
+
+static void tcache(Forth *f)
+{
+    uint16_t enabled = pop(f);
+    if (_quitting(f)) return;
+    emul_tcache(f->m, enabled != 0);
+}
+
+/* Primitives
+
+C versions of the z80 code of the z80/ sources. They have to leave the machine in the
+exact same state as the z80 code would: same memory, same stack and same
+registers (PC excepted). Like the z80 code, they don't check for underflows.
+*/
+
+static uint16_t zpop(Forth *f)
+{
+    return rawpop(f);
+}
+
+static void zpush(Forth *f, uint16_t x)
+{
+    push(f, x);
+    // Same as what emul_step() does, with the SP we'd have without the cache.
+    uint16_t sp = f->m->cpu.R1.wr.SP - 2*f->toscount;
+    if ((sp != 0) && (sp < f->m->minsp)) {
+        f->m->minsp = sp;
+    }
+}
+
+// Does what the trampoline added by z80entry() does: the return address pushed
+// by emul_call() is popped into IX.
+static void primenter(Forth *f)
+{
+    zpush(f, RETSTUB_ADDR);
+    f->m->cpu.R1.wr.IX = zpop(f);
+}
+
+static void prim_plus(Forth *f)
+{
+    ushort hl = zpop(f);
+    ushort de = zpop(f);
+    unsigned int sum = hl + de;
+    // ADD HL, DE: S, Z and P/V are unaffected, N is reset.
+    byte flags = f->m->cpu.R1.br.F & 0xc4;
+    flags |= (sum >> 8) & 0x28; // undocumented bits 3 and 5
+    if (((hl & 0xfff) + (de & 0xfff)) & 0x1000) {
+        flags |= 0x10; // H
+    }
+    if (sum & 0x10000) {
+        flags |= 0x01; // C
+    }
+    f->m->cpu.R1.br.F = flags;
+    f->m->cpu.R1.wr.HL = sum;
+    f->m->cpu.R1.wr.DE = de;
+    zpush(f, f->m->cpu.R1.wr.HL);
+}
+
+static void prim_swap(Forth *f)
+{
+    f->m->cpu.R1.wr.HL = zpop(f);
+    f->m->cpu.R1.wr.DE = zpop(f);
+    zpush(f, f->m->cpu.R1.wr.HL);
+    zpush(f, f->m->cpu.R1.wr.DE);
+}
+
+static void prim_dup(Forth *f)
+{
+    f->m->cpu.R1.wr.HL = zpop(f);
+    zpush(f, f->m->cpu.R1.wr.HL);
+    zpush(f, f->m->cpu.R1.wr.HL);
+}
+
+static void prim_storec(Forth *f)
+{
+    f->m->cpu.R1.wr.HL = zpop(f);
+    f->m->cpu.R1.wr.DE = zpop(f);
+    tosreach(f, f->m->cpu.R1.wr.HL, 1);
+    writeb(f, f->m->cpu.R1.wr.HL, f->m->cpu.R1.br.E);
+}
+
+static void prim_fetchc(Forth *f)
+{
+    f->m->cpu.R1.wr.HL = zpop(f);
+    tosreach(f, f->m->cpu.R1.wr.HL, 1);
+    f->m->cpu.R1.br.D = 0;
+    f->m->cpu.R1.br.E = f->m->mem[f->m->cpu.R1.wr.HL];
+    zpush(f, f->m->cpu.R1.wr.DE);
+}
+
+static void prim_store(Forth *f)
+{
+    f->m->cpu.R1.wr.HL = zpop(f);
+    f->m->cpu.R1.wr.DE = zpop(f);
+    tosreach(f, f->m->cpu.R1.wr.HL, 2);
+    writeb(f, f->m->cpu.R1.wr.HL++, f->m->cpu.R1.br.E);
+    writeb(f, f->m->cpu.R1.wr.HL, f->m->cpu.R1.br.D);
+}
+
+static void prim_fetch(Forth *f)
+{
+    f->m->cpu.R1.wr.HL = zpop(f);
+    tosreach(f, f->m->cpu.R1.wr.HL, 2);
+    f->m->cpu.R1.br.E = f->m->mem[f->m->cpu.R1.wr.HL++];
+    f->m->cpu.R1.br.D = f->m->mem[f->m->cpu.R1.wr.HL];
+    zpush(f, f->m->cpu.R1.wr.DE);
+}
+
+static void prim_over(Forth *f)
+{
+    f->m->cpu.R1.wr.HL = zpop(f);
+    f->m->cpu.R1.wr.DE = zpop(f);
+    zpush(f, f->m->cpu.R1.wr.DE);
+    zpush(f, f->m->cpu.R1.wr.HL);
+    zpush(f, f->m->cpu.R1.wr.DE);
+}
+
+static void prim_rot(Forth *f)
+{
+    f->m->cpu.R1.wr.HL = zpop(f);
+    f->m->cpu.R1.wr.DE = zpop(f);
+    f->m->cpu.R1.wr.BC = zpop(f);
+    zpush(f, f->m->cpu.R1.wr.DE);
+    zpush(f, f->m->cpu.R1.wr.HL);
+    zpush(f, f->m->cpu.R1.wr.BC);
+}
+
+static void prim_drop(Forth *f)
+{
+    f->m->cpu.R1.wr.HL = zpop(f);
+}
+
+static Primitive prims[] = {
+    {"+", plus_bin, sizeof(plus_bin), prim_plus},
+    {"swap", swap_bin, sizeof(swap_bin), prim_swap},
+    {"dup", dup_bin, sizeof(dup_bin), prim_dup},
+    {"C!", storec_bin, sizeof(storec_bin), prim_storec},
+    {"C@", fetchc_bin, sizeof(fetchc_bin), prim_fetchc},
+    {"!", store_bin, sizeof(store_bin), prim_store},
+    {"@", fetch_bin, sizeof(fetch_bin), prim_fetch},
+    {"over", over_bin, sizeof(over_bin), prim_over},
+    {"rot", rot_bin, sizeof(rot_bin), prim_rot},
+    {"drop", drop_bin, sizeof(drop_bin), prim_drop},
+};
+#define PRIMCOUNT (sizeof(prims)/sizeof(Primitive))
+_Static_assert(PRIMCOUNT <= PRIM_MAX, "PRIM_MAX too small");
+
+// Looks up the entries of our primitives. An entry only gets the C
+// implementation if its code is exactly what z80entry() wrote for it.
+static void bindprims(Forth *f)
+{
+    for (int i=0; i<PRIMCOUNT; i++) {
+        Primitive *p = &prims[i];
+        DictionaryEntry de = find(f, p->name);
+        f->primoffsets[i] = 0;
+        if ((de.offset == 0) || (de.type != TYPE_NATIVE)) {
+            continue;
+        }
+        byte *code = &f->m->mem[de.offset+ENTRY_FIELD_DATA];
+        if ((code[0] == 0xdd) && (code[1] == 0xe1) &&
+            (memcmp(&code[2], p->bin, p->binlen) == 0) &&
+            (code[p->binlen+2] == 0xdd) && (code[p->binlen+3] == 0xe9)) {
+            f->primoffsets[i] = de.offset;
+        }
+    }
+}
+
+// Returns the index in prims of the entry at offset, -1 if it's not one.
+static int findprim(Forth *f, uint16_t offset)
+{
+    for (int i=0; i<PRIMCOUNT; i++) {
+        if (f->primoffsets[i] == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Reports the first difference between the state left by the native and the
+// emulated version of a primitive. Returns true if there's none.
+static bool primcheck(Forth *f, int index, Machine *native)
+{
+    char name[NAME_LEN+1] = {0};
+    strncpy(name, prims[index].name, NAME_LEN);
+    for (int i=0; i<0x10000; i++) {
+        if (native->mem[i] != f->m->mem[i]) {
+            fprintf(stderr, "%s: mem[%04x] native %02x emulated %02x\n",
+                name, i, native->mem[i], f->m->mem[i]);
+            return false;
+        }
+    }
+    ushort *nregs = &native->cpu.R1.wr.AF;
+    ushort *eregs = &f->m->cpu.R1.wr.AF;
+    char *regnames[] = {"AF", "BC", "DE", "HL", "IX", "IY", "SP"};
+    for (int i=0; i<7; i++) {
+        if (nregs[i] != eregs[i]) {
+            fprintf(stderr, "%s: %s native %04x emulated %04x\n",
+                name, regnames[i], nregs[i], eregs[i]);
+            return false;
+        }
+    }
+    if (native->minsp != f->m->minsp) {
+        fprintf(stderr, "%s: min SP native %04x emulated %04x\n",
+            name, native->minsp, f->m->minsp);
+        return false;
+    }
+    return true;
+}
+
+// Copies registers and memory of src to dst.
+static void copystate(Machine *dst, Machine *src)
+{
+    dst->cpu = src->cpu;
+    dst->minsp = src->minsp;
+    memcpy(dst->mem, src->mem, 0x10000);
+}
+
+static void runprim(Forth *f, int index)
+{
+    Primitive *p = &prims[index];
+    switch (f->primmode) {
+        case PRIM_EMULATED:
+            runz80(f, f->primoffsets[index]+ENTRY_FIELD_DATA);
+            break;
+        case PRIM_NATIVE:
+            primenter(f);
+            p->fn(f);
+            break;
+        case PRIM_CHECK:
+            {
+                copystate(&f->checkbefore, f->m);
+                primenter(f);
+                p->fn(f);
+                copystate(&f->checknative, f->m);
+                copystate(f->m, &f->checkbefore);
+                emul_touch(f->m, 0, 0x10000);
+                // The emulated run is the reference, it's the one we keep.
+                runz80(f, f->primoffsets[index]+ENTRY_FIELD_DATA);
+                if (!primcheck(f, index, &f->checknative)) {
+                    error(f, "Primitive mismatch");
+                }
+            }
+            break;
+    }
+}
+
+// Z80 I/Os
+static uint8_t iord_stdio(Machine *m)
+{
+    Forth *f = m->hostctx;
+    con_flush(f);
+    int c = getchar();
+    if (c != EOF) {
+        return c & 0xff;
+    } else {
+        // EOF
+        return 0;
+    }
+}
+
+static void iowr_stdio(Machine *m, uint8_t val)
+{
+    Forth *f = m->hostctx;
+    con_putc(f, val);
+}
+
+static void iowr_dma(Machine *m, uint8_t val)
+{
+    Forth *f = m->hostctx;
+    uint16_t addr = m->cpu.R1.wr.HL;
+    uint16_t len = m->cpu.R1.wr.BC;
+    while (len--) {
+        con_putc(f, m->mem[addr++]);
+    }
+}
+
+/* Batch assembly
+
+Assembling each z80/ source through zasm.sh means reloading zasm.fth for each
+of them. In batch mode, we load it once and then assemble every file given to
+us, printing each result as a C array, the same way fth2c.sh used to do it
+with xxd. The dictionary is brought back to its post-assembler state between
+files, so that they can't see each other's definitions.
+*/
+
+
+static void iowr_asm(Machine *m, uint8_t val)
+{
+    Forth *f = m->hostctx;
+    if (f->asmlen < sizeof(f->asmbuf)) {
+        f->asmbuf[f->asmlen++] = val;
+    }
+}
+
+// Prints the array like "xxd -i" would.
+static void printcarray(Forth *f, char *name, byte *buf, unsigned int len)
+{
+    con_printf(f, "unsigned char %s_bin[] = { \n", name);
+    for (int i=0; i<len; i++) {
+        con_printf(f, (i % 12) ? " " : "  ");
+        con_printf(f, "0x%02x", buf[i]);
+        if (i < len-1) {
+            con_printf(f, ",");
+        }
+        if ((i % 12 == 11) || (i == len-1)) {
+            con_printf(f, "\n");
+        }
+    }
+    con_printf(f, " };\n");
+}
+
+static void asmbatch(Forth *f, int count, char *files[])
+{
+    char line[0x200];
+    // We load routines.fth in drop mode to have label variables set in our
+    // dict.
+    interpret_line(f, "loadf zasm.fth ' drop ZOUT ! loadf z80/routines.fth");
+    uint16_t here = readw(f, HERE_ADDR);
+    uint16_t current = readw(f, CURRENT_ADDR);
+    IOWR iowr = f->m->iowr[STDIO_PORT];
+    for (int i=0; i<count; i++) {
+        // "basename $fn .fth"
+        char *name = strrchr(files[i], '/');
+        name = (name != NULL) ? name+1 : files[i];
+        int namelen = strlen(name);
+        if ((namelen > 4) && (strcmp(&name[namelen-4], ".fth") == 0)) {
+            namelen -= 4;
+        }
+        snprintf(line, sizeof(line), "0 PC ! ' emit ZOUT ! loadf %s", files[i]);
+        f->asmlen = 0;
+        f->m->iowr[STDIO_PORT] = iowr_asm;
+        interpret_line(f, line);
+        f->m->iowr[STDIO_PORT] = iowr;
+        snprintf(line, sizeof(line), "%.*s", namelen, name);
+        printcarray(f, line, f->asmbuf, f->asmlen);
+        writew(f, HERE_ADDR, here);
+        writew(f, CURRENT_ADDR, current);
+        dictsync(f);
+    }
+}
+
+/* Translation to C
+
+Core words are defined in core.fth, but they don't have to run as threaded
+code. "./forth -c core.fth" loads it and prints each definition as a C
+function, which core-bin.h holds and init_dict() registers as a native entry.
+Like z80-bin.h, core-bin.h is made by "make bootstrap" and is in git. Loading
+core.fth from the interpreter gives the threaded version back.
+
+Calls to primitives, natives and definitions from the same file become C
+calls. Natives are called by index, so native_funcs only ever grows at its
+end. Anything else, like z80 entries and cells, is an entry listed in
+CORE_REFS. bindcore() finds those by name once, as define() would have, from
+the entries that come before the core words, and keeps their offsets in
+corerefs. compact() keeps them alive and relocates them. As in run(), we stop
+as soon as we quit.
+*/
+
+static void cname(Forth *f, uint16_t offset)
+{
+    char name[NAME_LEN+1] = {0};
+    strncpy(name, &f->m->mem[offset+ENTRY_FIELD_NAME], NAME_LEN);
+    for (char *c=name; *c; c++) {
+        if ((*c == '"') || (*c == '\\')) {
+            con_putc(f, '\\');
+        }
+        con_putc(f, *c);
+    }
+}
+
+static void ctranslate(Forth *f, char *path)
+{
+    char line[0x200];
+    uint16_t last = readw(f, CURRENT_ADDR);
+    snprintf(line, sizeof(line), "loadf %s", path);
+    interpret_line(f, line);
+    uint16_t defs[0x100];
+    int count = 0;
+    for (uint16_t o=readw(f, CURRENT_ADDR); o!=last; o=readw(f, o+ENTRY_FIELD_PREV)) {
+        if (count == sizeof(defs)/sizeof(uint16_t)) {
+            fprintf(stderr, "Too many definitions in %s\n", path);
+            return;
+        }
+        defs[count++] = o;
+    }
+    // Oldest first
+    for (int i=0; i<count/2; i++) {
+        uint16_t o = defs[i];
+        defs[i] = defs[count-1-i];
+        defs[count-1-i] = o;
+    }
+    uint16_t refs[COREREFS_MAX];
+    int refcount = 0;
+    for (int i=0; i<count; i++) {
+        if (f->m->mem[defs[i]+ENTRY_FIELD_TYPE] != TYPE_COMPILED) {
+            fprintf(stderr, "Can't translate entry %d of %s\n", i, path);
+            return;
+        }
+        ThreadedCode *tc = getthreaded(f, defs[i]);
+        con_printf(f, "\n// : ");
+        cname(f, defs[i]);
+        for (ThreadItem *ti=tc->items; ti->op!=OP_EXIT; ti++) {
+            con_printf(f, " ");
+            if (ti->op == OP_NUM) {
+                con_printf(f, "%d", ti->arg);
+            } else {
+                cname(f, ti->entry);
+            }
+        }
+        con_printf(f, " ;\nstatic void core_%d(Forth *f)\n{\n", i);
+        for (ThreadItem *ti=tc->items; ti->op!=OP_EXIT; ti++) {
+            if (ti != tc->items) {
+                con_printf(f, "    if (_quitting(f)) return;\n");
+            }
+            int callee = -1;
+            for (int j=0; j<i; j++) {
+                if ((ti->op == OP_COMPILED) && (ti->arg == defs[j])) {
+                    callee = j;
+                }
+            }
+            if (ti->op == OP_NUM) {
+                con_printf(f, "    push(f, 0x%04x);\n", ti->arg);
+            } else if (ti->op == OP_PRIM) {
+                con_printf(f, "    runprim(f, %d);\n", ti->arg);
+            } else if (ti->op == OP_NATIVE) {
+                con_printf(f, "    call_native(f, %d);\n", ti->arg);
+            } else if (callee >= 0) {
+                con_printf(f, "    core_%d(f);\n", callee);
+            } else {
+                int ref = 0;
+                while ((ref < refcount) && (refs[ref] != ti->entry)) {
+                    ref++;
+                }
+                if (ref == refcount) {
+                    if (refcount == COREREFS_MAX) {
+                        fprintf(stderr, "Too many references in %s\n", path);
+                        return;
+                    }
+                    refs[refcount++] = ti->entry;
+                }
+                if (ti->op == OP_Z80) {
+                    con_printf(f, "    runz80(f, f->corerefs[%d]+ENTRY_FIELD_DATA);\n", ref);
+                } else if (ti->op == OP_CELL) {
+                    con_printf(f, "    push(f, f->corerefs[%d]+ENTRY_FIELD_DATA);\n", ref);
+                } else {
+                    con_printf(f, "    run(f, f->corerefs[%d]);\n", ref);
+                }
+            }
+        }
+        con_printf(f, "}\n");
+    }
+    con_printf(f, "\n#define CORE_FUNCS");
+    for (int i=0; i<count; i++) {
+        con_printf(f, "%s core_%d", (i > 0) ? "," : "", i);
+    }
+    con_printf(f, "\n#define CORE_NAMES");
+    for (int i=0; i<count; i++) {
+        con_printf(f, "%s \"", (i > 0) ? "," : "");
+        cname(f, defs[i]);
+        con_printf(f, "\"");
+    }
+    con_printf(f, "\n#define CORE_REFS");
+    for (int i=0; i<refcount; i++) {
+        con_printf(f, "%s \"", (i > 0) ? "," : "");
+        cname(f, refs[i]);
+        con_printf(f, "\"");
+    }
+    con_printf(f, "\n");
+}
+
+#include "core-bin.h"
+
+static char *corenames[] = {CORE_NAMES};
+#define CORECOUNT (sizeof(corenames)/sizeof(char*))
+static char *corerefnames[] = {CORE_REFS};
+#define COREREFCOUNT (sizeof(corerefnames)/sizeof(char*))
+_Static_assert(COREREFCOUNT <= COREREFS_MAX, "COREREFS_MAX too small");
+
+
+/* Superinstructions
+
+Sequences of primitives that often run together can be fused in a single
+entry, a superinstruction, which costs one dispatch instead of one per
+primitive. Its z80 code is the concatenation of theirs, between a single
+trampoline, so it can be run and saved like any other z80 entry. We
+recognize superinstructions from their code, as bindprims() does, and
+threaded code decoded after one is created uses it. Their names start with a
+space, which no word we read has: they can't be found, nor hide a word.
+
+Only primitives are fused: other z80 entries might jump around in their own
+code, and compiled words and literals would need their own matching. When
+primitives run natively, a superinstruction runs their C code in a row, which
+saves dispatches and nothing else.
+
+With "1 seqprof", run() counts the pairs and triples of primitives it runs
+from compiled code. "n synth" then creates superinstructions for the n
+hottest of them. "supers" prints the current set as "super" lines that can be
+loaded back, in a build for example.
+*/
+
+
+// ti is an OP_PRIM and is followed at least by OP_EXIT.
+static void countseq(Forth *f, ThreadItem *ti)
+{
+    if (ti[1].op != OP_PRIM) return;
+    f->seqcounts2[ti[0].arg][ti[1].arg]++;
+    if (ti[2].op != OP_PRIM) return;
+    f->seqcounts3[ti[0].arg][ti[1].arg][ti[2].arg]++;
+}
+
+static void runsuper(Forth *f, int index)
+{
+    Super *s = &f->supers[index];
+    if (f->primmode == PRIM_EMULATED) {
+        runz80(f, s->offset+ENTRY_FIELD_DATA);
+    } else {
+        // In check mode, each primitive is checked on its own.
+        for (int i=0; i<s->len; i++) {
+            runprim(f, s->prims[i]);
+        }
+    }
+}
+
+// Matches code against a sequence of at least 2 bound primitives followed by
+// JP (IX). Returns the length of the sequence, 0 if there's no match.
+static int matchseq(Forth *f, byte *code, int *seq, int len)
+{
+    if ((len >= 2) && (code[0] == 0xdd) && (code[1] == 0xe9)) {
+        return len;
+    }
+    if (len == SUPER_MAXLEN) {
+        return 0;
+    }
+    for (int i=0; i<PRIMCOUNT; i++) {
+        Primitive *p = &prims[i];
+        if ((f->primoffsets[i] > 0) && (memcmp(code, p->bin, p->binlen) == 0)) {
+            seq[len] = i;
+            int r = matchseq(f, code+p->binlen, seq, len+1);
+            if (r > 0) {
+                return r;
+            }
+        }
+    }
+    return 0;
+}
+
+static int findsuper(Super *list, int count, int *seq, int len)
+{
+    for (int i=0; i<count; i++) {
+        if ((list[i].len == len) &&
+            (memcmp(list[i].prims, seq, len*sizeof(int)) == 0)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Rebuilds supers from the dictionary. Callers have to bump dict_gen.
+static void bindsupers(Forth *f)
+{
+    Super found[SUPER_MAX];
+    int count = 0;
+    uint16_t offset = readw(f, CURRENT_ADDR);
+    while ((offset > 0) && (count < SUPER_MAX)) {
+        DictionaryEntry de;
+        readentry(f, &de, offset);
+        byte *code = &f->m->mem[offset+ENTRY_FIELD_DATA];
+        if ((de.type == TYPE_NATIVE) && (code[0] == 0xdd) && (code[1] == 0xe1)) {
+            Super *s = &found[count];
+            s->offset = offset;
+            s->len = matchseq(f, &code[2], s->prims, 0);
+            // Newest wins, like in find().
+            if ((s->len > 0) &&
+                (findsuper(found, count, s->prims, s->len) < 0)) {
+                count++;
+            }
+        }
+        offset = de.prev;
+    }
+    for (int i=0; i<count; i++) {
+        f->supers[i] = found[count-1-i];
+    }
+    f->supercount = count;
+}
+
+// Creates the superinstruction for seq if it doesn't exist yet.
+static void newsuper(Forth *f, int *seq, int len)
+{
+    if (findsuper(f->supers, f->supercount, seq, len) >= 0) {
+        return;
+    }
+    if (f->supercount == SUPER_MAX) {
+        error(f, "Too many superinstructions");
+        return;
+    }
+    char name[0x40] = " ";
+    unsigned char bin[0x100];
+    uint16_t binlen = 0;
+    for (int i=0; i<len; i++) {
+        Primitive *p = &prims[seq[i]];
+        if (i > 0) {
+            strcat(name, "_");
+        }
+        strcat(name, p->name);
+        memcpy(&bin[binlen], p->bin, p->binlen);
+        binlen += p->binlen;
+    }
+    z80entry(f, name, bin, binlen);
+    bindsupers(f);
+    f->dict_gen++;
+}
+
+static void seqprof(Forth *f)
+{
+    uint16_t enabled = pop(f);
+    if (_quitting(f)) return;
+    f->seqprofiling = enabled != 0;
+    if (f->seqprofiling) {
+        memset(f->seqcounts2, 0, sizeof(f->seqcounts2));
+        memset(f->seqcounts3, 0, sizeof(f->seqcounts3));
+    }
+}
+
+static void synth(Forth *f)
+{
+    uint16_t n = pop(f);
+    if (_quitting(f)) return;
+    while (n-- > 0) {
+        // A sequence of len primitives saves len-1 dispatches each time it
+        // runs.
+        uint64_t best = 0;
+        uint32_t *bestcount;
+        int seq[SUPER_MAXLEN];
+        int len = 0;
+        for (int a=0; a<PRIMCOUNT; a++) {
+            for (int b=0; b<PRIMCOUNT; b++) {
+                if (f->seqcounts2[a][b] > best) {
+                    best = f->seqcounts2[a][b];
+                    bestcount = &f->seqcounts2[a][b];
+                    seq[0] = a; seq[1] = b;
+                    len = 2;
+                }
+                for (int c=0; c<PRIMCOUNT; c++) {
+                    if ((uint64_t)f->seqcounts3[a][b][c] * 2 > best) {
+                        best = (uint64_t)f->seqcounts3[a][b][c] * 2;
+                        bestcount = &f->seqcounts3[a][b][c];
+                        seq[0] = a; seq[1] = b; seq[2] = c;
+                        len = 3;
+                    }
+                }
+            }
+        }
+        if (best == 0) {
+            break;
+        }
+        *bestcount = 0;
+        newsuper(f, seq, len);
+        if (_quitting(f)) return;
+    }
+}
+
+static void super(Forth *f)
+{
+    int seq[SUPER_MAXLEN];
+    int len = 0;
+    char *word = readword(f);
+    while ((word != NULL) && (*word) && (strcmp(word, ";") != 0)) {
+        DictionaryEntry de = find(f, word);
+        int prim = (de.offset > 0) ? findprim(f, de.offset) : -1;
+        if (prim < 0) {
+            fprintf(stderr, "%s is not a primitive\n", word);
+            error(f, NULL);
+            return;
+        }
+        if (len == SUPER_MAXLEN) {
+            error(f, "Sequence too long");
+            return;
+        }
+        seq[len++] = prim;
+        word = readword(f);
+    }
+    if (len < 2) {
+        error(f, "Sequence too short");
+        return;
+    }
+    newsuper(f, seq, len);
+}
+
+static void supers_(Forth *f)
+{
+    for (int i=0; i<f->supercount; i++) {
+        con_printf(f, "super");
+        for (int j=0; j<f->supers[i].len; j++) {
+            con_printf(f, " %s", prims[f->supers[i].prims[j]].name);
+        }
+        con_printf(f, " ;\n");
+    }
+}
+
+// Main loop
+static Callable native_funcs[] = {
+    bye, dot, execute, define, loadf,
+    forget, create, regr, regw, minus, mult, div_,
+    and_, or_, lshift, rshift, call, dotx, apos, see, primmode_,
+    tcache, saveimage, loadimage, optimize_,
+    inline_, seqprof, synth, super, supers_, profon, profoff, profrst,
+    profile, profcsv, zstats, zdump, cflush, blkfile, block, buffer, update,
+    flush, fork_, commit, discard, checkpoint, savediff, loaddiff, compact,
+    banks, bank, zcompile, CORE_FUNCS};
+
+static void call_native(Forth *f, int index)
+{
+    native_funcs[index](f);
+}
+
+// Binds CORE_REFS. A name that isn't there anymore keeps its binding.
+static void bindcore(Forth *f)
+{
+    int first = sizeof(native_funcs)/sizeof(Callable) - CORECOUNT;
+    uint16_t o = readw(f, CURRENT_ADDR);
+    while ((o > 0) && ((f->m->mem[o+ENTRY_FIELD_TYPE] != TYPE_NATIVE) ||
+        (readw(f, o+ENTRY_FIELD_DATA) != first))) {
+        o = readw(f, o+ENTRY_FIELD_PREV);
+    }
+    if (o == 0) {
+        return;
+    }
+    uint16_t core = readw(f, o+ENTRY_FIELD_PREV);
+    for (int i=0; i<COREREFCOUNT; i++) {
+        o = core;
+        while ((o > 0) && (strncmp(&f->m->mem[o+ENTRY_FIELD_NAME],
+            corerefnames[i], NAME_LEN) != 0)) {
+            o = readw(f, o+ENTRY_FIELD_PREV);
+        }
+        if (o > 0) {
+            f->corerefs[i] = o;
+        }
+    }
+}
+
+/* Optimizer
+
+When enabled, define() runs the items of a new definition through a peephole
+pass before writing them to the heap. Rewrites only apply to words that are
+still bound to our builtins at compile time: a word redefined by the user is
+left alone. Since items refer to entries by offset, the result is the same
+whatever is defined later.
+
+Rewrites only ever act on literals the word pushes itself, so that they can't
+hide a stack underflow: "swap swap" or "0 +" are left alone, since they'd raise
+one on a short stack. What they don't keep is the registers and flags the
+removed primitives would have left, which regr shows. Running primitives
+natively doesn't change that, since their C code leaves registers as the z80
+code does.
+*/
+
+typedef enum {
+    OPT_OTHER,
+    OPT_NUM,
+    OPT_PLUS,
+    OPT_MINUS,
+    OPT_MULT,
+    OPT_DIV,
+    OPT_AND,
+    OPT_OR,
+    OPT_LSHIFT,
+    OPT_RSHIFT,
+    OPT_SWAP,
+    OPT_DUP,
+    OPT_DROP
+} OptKind;
+
+static OptKind optkind(Forth *f, HeapItem *hi)
+{
+    if (hi->type == TYPE_NUM) {
+        return OPT_NUM;
+    }
+    DictionaryEntry de;
+    readentry(f, &de, hi->arg);
+    if (de.type != TYPE_NATIVE) {
+        return OPT_OTHER;
+    }
+    if (de.arg < NATIVE_MAX) {
+        Callable fn = native_funcs[de.arg];
+        if (fn == minus) return OPT_MINUS;
+        if (fn == mult) return OPT_MULT;
+        if (fn == div_) return OPT_DIV;
+        if (fn == and_) return OPT_AND;
+        if (fn == or_) return OPT_OR;
+        if (fn == lshift) return OPT_LSHIFT;
+        if (fn == rshift) return OPT_RSHIFT;
+        return OPT_OTHER;
+    }
+    int prim = findprim(f, de.offset);
+    if (prim < 0) {
+        return OPT_OTHER;
+    }
+    Callable fn = prims[prim].fn;
+    if (fn == prim_plus) return OPT_PLUS;
+    if (fn == prim_swap) return OPT_SWAP;
+    if (fn == prim_dup) return OPT_DUP;
+    if (fn == prim_drop) return OPT_DROP;
+    return OPT_OTHER;
+}
+
+// Computes "n1 n2 op" in *result. Returns false if we can't do it at compile
+// time.
+static bool fold(OptKind op, uint16_t n1, uint16_t n2, uint16_t *result)
+{
+    switch (op) {
+        case OPT_PLUS: *result = n1 + n2; return true;
+        case OPT_MINUS: *result = n1 - n2; return true;
+        case OPT_MULT: *result = n1 * n2; return true;
+        case OPT_DIV:
+            // Division by zero is left to happen at runtime.
+            if (n2 == 0) return false;
+            *result = n1 / n2;
+            return true;
+        case OPT_AND: *result = n1 & n2; return true;
+        case OPT_OR: *result = n1 | n2; return true;
+        case OPT_LSHIFT:
+            if (n2 >= 16) return false;
+            *result = n1 << n2;
+            return true;
+        case OPT_RSHIFT:
+            if (n2 >= 16) return false;
+            *result = n1 >> n2;
+            return true;
+        default: return false;
+    }
+}
+
+// Rewrites the last items of items[0..*count]. Returns whether something
+// changed.
+static bool peephole(Forth *f, HeapItem *items, int *count)
+{
+    int n = *count;
+    HeapItem *a = (n >= 3) ? &items[n-3] : NULL;
+    HeapItem *b = (n >= 2) ? &items[n-2] : NULL;
+    HeapItem *c = &items[n-1];
+    OptKind ka = a ? optkind(f, a) : OPT_OTHER;
+    OptKind kb = b ? optkind(f, b) : OPT_OTHER;
+    OptKind kc = optkind(f, c);
+    uint16_t r;
+    if ((ka == OPT_NUM) && (kb == OPT_NUM)) {
+        // n1 n2 op -> n
+        if (fold(kc, a->arg, b->arg, &r)) {
+            a->arg = r;
+            *count -= 2;
+            return true;
+        }
+        // n1 n2 swap -> n2 n1
+        if (kc == OPT_SWAP) {
+            r = a->arg;
+            a->arg = b->arg;
+            b->arg = r;
+            *count -= 1;
+            return true;
+        }
+    }
+    if (kb == OPT_NUM) {
+        // n dup -> n n
+        if (kc == OPT_DUP) {
+            *c = *b;
+            return true;
+        }
+        // n drop -> nothing
+        if (kc == OPT_DROP) {
+            *count -= 2;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the new item count.
+static int optimize(Forth *f, HeapItem *items, int count)
+{
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        int out = 0;
+        for (int i=0; i<count; i++) {
+            items[out++] = items[i];
+            while ((out > 0) && peephole(f, items, &out)) {
+                changed = true;
+            }
+        }
+        count = out;
+    }
+    return count;
+}
+
+/* z80 compilation
+
+With "1 zcompile", define() compiles a definition to z80 code instead of
+threaded code when all it uses is numbers, cells and z80 entries. Running it
+is then a single call to the emulator, with no trip back to the host between
+its words. It's a TYPE_ZCOMPILED entry, called like those z80entry() creates:
+
+    POP IX              dd e1
+    LD (slot), IX       dd 22 <slot>
+    <code of items>
+    LD IX, (slot)       dd 2a <slot>
+    JP (IX)             dd e9
+    slot:               <2 bytes>
+    <items>             heap items, as in a compiled word
+
+The return address is kept in slot because the entries we call use IX
+themselves. Numbers and addresses of cells are pushed with LD HL, n / PUSH HL.
+The code of an entry that's only primitives
+between its trampoline, like primitives and superinstructions, is copied in
+place. Other z80 entries are called with CALL.
+
+The items are kept so that compact() can relocate them and write the code
+again. Copying code depends only on the entries' code, so the code keeps its
+length. A word that quits, like abort, stops the interpreter only once the
+whole definition returned.
+*/
+
+// Returns the length of primitives' code at code, up to JP (IX), -1 if code
+// isn't only primitives.
+static int primslen(byte *code)
+{
+    if ((code[0] == 0xdd) && (code[1] == 0xe9)) {
+        return 0;
+    }
+    for (int i=0; i<PRIMCOUNT; i++) {
+        Primitive *p = &prims[i];
+        if (memcmp(code, p->bin, p->binlen) == 0) {
+            int len = primslen(code+p->binlen);
+            if (len >= 0) {
+                return p->binlen + len;
+            }
+        }
+    }
+    return -1;
+}
+
+// Returns the length of the code for hi, -1 if it can't be compiled. If code
+// is not NULL, writes it there.
+static int zitem(Forth *f, HeapItem *hi, byte *code)
+{
+    byte buf[4];
+    byte *p = (code != NULL) ? code : buf;
+    uint16_t val = hi->arg;
+    int len = 4;
+    // LD HL, val / PUSH HL
+    p[0] = 0x21;
+    p[3] = 0xe5;
+    if (hi->type == TYPE_WORD) {
+        DictionaryEntry de;
+        readentry(f, &de, hi->arg);
+        byte *body = &f->m->mem[de.offset+ENTRY_FIELD_DATA];
+        val = de.offset+ENTRY_FIELD_DATA;
+        if ((de.type == TYPE_COMPILED) ||
+            ((de.type == TYPE_NATIVE) && (de.arg < NATIVE_MAX))) {
+            return -1;
+        } else if ((de.type == TYPE_NATIVE) && (body[0] == 0xdd) &&
+            (body[1] == 0xe1) && (primslen(&body[2]) >= 0)) {
+            len = primslen(&body[2]);
+            if (code != NULL) {
+                memcpy(code, &body[2], len);
+            }
+            return len;
+        } else if ((de.type == TYPE_NATIVE) || (de.type == TYPE_ZCOMPILED)) {
+            // CALL val
+            p[0] = 0xcd;
+            len = 3;
+        }
+    }
+    p[1] = val & 0xff;
+    p[2] = val >> 8;
+    return len;
+}
+
+// Writes the code of the definition whose data starts at start and whose
+// slot, followed by its items, is at slot.
+static void zwrite(Forth *f, uint16_t start, uint16_t slot)
+{
+    byte *code = &f->m->mem[start];
+    byte *p = code;
+    *p++ = 0xdd;
+    *p++ = 0xe1;
+    *p++ = 0xdd;
+    *p++ = 0x22;
+    *p++ = slot & 0xff;
+    *p++ = slot >> 8;
+    HeapItem hi = readheap(f, slot+2);
+    while (hi.type != TYPE_STOP) {
+        p += zitem(f, &hi, p);
+        hi = readheap(f, hi.next);
+    }
+    *p++ = 0xdd;
+    *p++ = 0x2a;
+    *p++ = slot & 0xff;
+    *p++ = slot >> 8;
+    *p++ = 0xdd;
+    *p++ = 0xe9;
+    emul_touch(f->m, start, p-code);
+}
+
+// Compiles items in de, which has just been created. Returns false, writing
+// nothing, if one of them can't be compiled.
+static bool zdefine(Forth *f, DictionaryEntry *de, HeapItem *items, int count)
+{
+    // trampoline and slot save, slot restore and jump
+    int len = 6 + 6;
+    for (int i=0; i<count; i++) {
+        int itemlen = zitem(f, &items[i], NULL);
+        if (itemlen < 0) {
+            return false;
+        }
+        len += itemlen;
+    }
+    uint16_t start = de->offset+ENTRY_FIELD_DATA;
+    uint16_t slot = start+len;
+    // Leave it to define() to error out when there's no room.
+    if (slot+2+count*3+1 > DICT_ADDR+DICT_SIZE) {
+        return false;
+    }
+    writeb(f, de->offset+ENTRY_FIELD_TYPE, TYPE_ZCOMPILED);
+    writew(f, HERE_ADDR, slot+2);
+    for (int i=0; i<count; i++) {
+        writeheap(f, &items[i]);
+    }
+    HeapItem hi;
+    hi.type = TYPE_STOP;
+    writeheap(f, &hi);
+    zwrite(f, start, slot);
+    return true;
+}
+
+// Returns the offset of the items of the definition compiled to z80 code at
+// offset, 0 if the entry at offset isn't one.
+static uint16_t zheap(Forth *f, uint16_t offset)
+{
+    if (f->m->mem[offset+ENTRY_FIELD_TYPE] != TYPE_ZCOMPILED) {
+        return 0;
+    }
+    return readw(f, offset+ENTRY_FIELD_DATA+4)+2;
+}
+
+static void nativeentry(Forth *f, char *name, int index)
+{
+    DictionaryEntry de = _create(f, name, TYPE_NATIVE, 2);
+    writew(f, de.offset+ENTRY_FIELD_DATA, index);
+}
+
+// z80 code in bin works directly on the stack. Because it's called with a
+// return address on top of it, we wrap it in a trampoline which keeps that
+// return address in IX:
+//
+//     POP IX (0xdd 0xe1)
+//     <bin>
+//     JP (IX) (0xdd 0xe9)
+static void z80entry(Forth *f, char *name, unsigned char* bin, uint16_t binlen)
+{
+    DictionaryEntry de = _create(f, name, TYPE_NATIVE, binlen+4);
+    uint16_t offset = de.offset+ENTRY_FIELD_DATA;
+    writeb(f, offset++, 0xdd);
+    writeb(f, offset++, 0xe1);
+    for (int i=0; i<binlen; i++) {
+        writeb(f, offset++, bin[i]);
+    }
+    writeb(f, offset++, 0xdd);
+    writeb(f, offset++, 0xe9);
+}
+
+static void init_dict(Forth *f)
+{
+    int i = 0;
+    // same order as in native_funcs
+    nativeentry(f, "bye", i++);
+    nativeentry(f, ".", i++);
+    nativeentry(f, "execute", i++);
+    nativeentry(f, ":", i++);
+    nativeentry(f, "loadf", i++);
+    nativeentry(f, "forget", i++);
+    nativeentry(f, "create", i++);
+    nativeentry(f, "regr", i++);
+    nativeentry(f, "regw", i++);
+    nativeentry(f, "-", i++);
+    nativeentry(f, "*", i++);
+    nativeentry(f, "/", i++);
+    nativeentry(f, "and", i++);
+    nativeentry(f, "or", i++);
+    nativeentry(f, "lshift", i++);
+    nativeentry(f, "rshift", i++);
+    nativeentry(f, "call", i++);
+    nativeentry(f, ".x", i++);
+    nativeentry(f, "'", i++);
+    nativeentry(f, "see", i++);
+    nativeentry(f, "primmode", i++);
+    nativeentry(f, "tcache", i++);
+    nativeentry(f, "save-image", i++);
+    nativeentry(f, "load-image", i++);
+    nativeentry(f, "optimize", i++);
+    nativeentry(f, "inline", i++);
+    nativeentry(f, "seqprof", i++);
+    nativeentry(f, "synth", i++);
+    nativeentry(f, "super", i++);
+    nativeentry(f, "supers", i++);
+    nativeentry(f, "profon", i++);
+    nativeentry(f, "profoff", i++);
+    nativeentry(f, "profrst", i++);
+    nativeentry(f, "profile", i++);
+    nativeentry(f, "profcsv", i++);
+    nativeentry(f, "zstats", i++);
+    nativeentry(f, "zdump", i++);
+    nativeentry(f, "cflush", i++);
+    nativeentry(f, "blkfile", i++);
+    nativeentry(f, "block", i++);
+    nativeentry(f, "buffer", i++);
+    nativeentry(f, "update", i++);
+    nativeentry(f, "flush", i++);
+    nativeentry(f, "fork", i++);
+    nativeentry(f, "commit", i++);
+    nativeentry(f, "discard", i++);
+    nativeentry(f, "checkpoint", i++);
+    nativeentry(f, "save-diff", i++);
+    nativeentry(f, "load-diff", i++);
+    nativeentry(f, "compact", i++);
+    nativeentry(f, "banks", i++);
+    nativeentry(f, "bank", i++);
+    nativeentry(f, "zcompile", i++);
+    z80entry(f, "+", plus_bin, sizeof(plus_bin));
+    z80entry(f, "swap", swap_bin, sizeof(swap_bin));
+    z80entry(f, "emit", emit_bin, sizeof(emit_bin));
+    z80entry(f, "dup", dup_bin, sizeof(dup_bin));
+    z80entry(f, "here", here_bin, sizeof(here_bin));
+    z80entry(f, "current", current_bin, sizeof(current_bin));
+    z80entry(f, "C!", storec_bin, sizeof(storec_bin));
+    z80entry(f, "C@", fetchc_bin, sizeof(fetchc_bin));
+    z80entry(f, "!", store_bin, sizeof(store_bin));
+    z80entry(f, "@", fetch_bin, sizeof(fetch_bin));
+    z80entry(f, "over", over_bin, sizeof(over_bin));
+    z80entry(f, "rot", rot_bin, sizeof(rot_bin));
+    z80entry(f, "drop", drop_bin, sizeof(drop_bin));
+    z80entry(f, "quit", quit_bin, sizeof(quit_bin));
+    z80entry(f, "abort", abort_bin, sizeof(abort_bin));
+    // Core words come last since they can use any of the above.
+    for (int j=0; j<CORECOUNT; j++) {
+        nativeentry(f, corenames[j], i++);
+    }
+    bindcore(f);
+}
+
+// Returns a new Forth with its own Machine, or NULL if we're out of memory or
+// Machines. Its memory is empty: it still needs a dictionary.
+static Forth* forth_new()
+{
+    Forth *f = calloc(1, sizeof(Forth));
+    if (f == NULL) {
+        return NULL;
+    }
+    f->m = emul_init();
+    if (f->m == NULL) {
+        free(f);
+        return NULL;
+    }
+    f->m->hostctx = f;
+    f->m->watch = f->threadmap;
+    f->m->iord[STDIO_PORT] = iord_stdio;
+    f->m->iowr[STDIO_PORT] = iowr_stdio;
+    f->m->iowr[DMA_PORT] = iowr_dma;
+    f->m->iord[BLK_PORT] = iord_blk;
+    f->m->iowr[BLK_PORT] = iowr_blk;
+    f->m->iord[BANK_PORT] = iord_bank;
+    f->m->iowr[BANK_PORT] = iowr_bank;
+    f->stdinsrc.fp = stdin;
+    f->cursrc = &f->stdinsrc;
+    f->primmode = PRIM_NATIVE;
+    f->toscap = TOS_CACHE;
+    f->rsp = RSTACK_ADDR;
+    f->checkbefore.mem = f->checkmem[0];
+    f->checknative.mem = f->checkmem[1];
+    f->running = true;
+    blkflush(f);
+    return f;
+}
+
+// Flushes pending output and block buffers and frees f.
+static void forth_free(Forth *f)
+{
+    con_flush(f);
+    if (f->parent != NULL) {
+        // As discard does: the fork's buffers go with it.
+        f->m = emul_discard(f->m);
+        f->parent = NULL;
+        blkdrop(f);
+    }
+    blkflush(f);
+    if (f->blkmap != NULL) {
+        munmap(f->blkmap, f->blkcount*BLK_SIZE);
+    }
+    for (int i=0; i<0x10000; i++) {
+        free(f->threaded[i]);
+    }
+    freestale(f);
+    free(f->profdata);
+    free(f->stdinsrc.buf);
+    emul_free(f->m);
+    free(f);
+}
+
+int main(int argc, char *argv[])
+{
+    Forth *f = forth_new();
+    if (f == NULL) {
+        fprintf(stderr, "Can't create machine\n");
+        return 1;
+    }
+    int argi = 1;
+    if ((argc > 2) && (strcmp(argv[1], "-i") == 0)) {
+        // Start from an image made by save-image instead of building our
+        // dictionary.
+        if (!emul_load(f->m, argv[2])) {
+            fprintf(stderr, "Can't load image %s\n", argv[2]);
+            forth_free(f);
+            return 1;
+        }
+        dictsync(f);
+        argi = 3;
+    } else {
+        f->m->cpu.R1.wr.SP = 0xffff;
+        writew(f, HERE_ADDR, DICT_ADDR);
+        writew(f, CURRENT_ADDR, 0);
+        writew(f, FORGOTTEN_ADDR, 0);
+        // Copy system routines in memory
+        for (int i=0; i<sizeof(routines_bin); i++) {
+            writeb(f, ROUTINES_ADDR+i, routines_bin[i]);
+        }
+        // HALT, HALT
+        writeb(f, RETSTUB_ADDR-1, 0x76);
+        writeb(f, RETSTUB_ADDR, 0x76);
+        init_dict(f);
+        bindprims(f);
+    }
+    if ((argc > argi+1) && (strcmp(argv[argi], "-c") == 0)) {
+        ctranslate(f, argv[argi+1]);
+        forth_free(f);
+        return 0;
+    }
+    if ((argc > argi) && (strcmp(argv[argi], "-a") == 0)) {
+        // Batch assembly of the files that follow.
+        asmbatch(f, argc-argi-1, &argv[argi+1]);
+        forth_free(f);
+        return 0;
+    }
+    if (argc > argi) {
         // We have arguments. Interpret then and exit
-        for (int i=1; i<argc; i++) {
-            interpret_line(argv[i]);
+        for (int i=argi; i<argc; i++) {
+            interpret_line(f, argv[i]);
         }
+        forth_free(f);
         return 0;
     }
     char inputbuf[0x200];
-    while (running) {
-        _unquit();
-        while (interpret() && running && !_quitting() && m->mem[LASTWS_ADDR] != '\n');
-        if (_quitting()) { // exhaust the current line
-            int c = m->mem[LASTWS_ADDR];
+    while (f->running) {
+        _unquit(f);
+        while (interpret(f) && f->running && !_quitting(f) && f->m->mem[LASTWS_ADDR] != '\n');
+        if (_quitting(f)) { // exhaust the current line
+            int c = f->m->mem[LASTWS_ADDR];
             while (c != '\n') {
-                c = readc();
+                c = readc(f);
             }
-        } else if (running) {
-            printf(" ok\n");
+        } else if (f->running) {
+            con_printf(f, " ok\n");
         }
     }
+    forth_free(f);
     return 0;
 }
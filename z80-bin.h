@@ -16,10 +16,10 @@ unsigned char dup_bin[] = {
   0xe1, 0xe5, 0xe5
  };
 unsigned char here_bin[] = { 
-  0xc3, 0x08, 0x10, 0xe5
+  0xcd, 0x08, 0x10, 0xe5
  };
 unsigned char current_bin[] = { 
-  0xc3, 0x04, 0x10, 0xe5
+  0xcd, 0x04, 0x10, 0xe5
  };
 unsigned char storec_bin[] = { 
   0xe1, 0xd1, 0x73